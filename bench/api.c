@@ -0,0 +1,68 @@
+// Per-call overhead of the embedding API: evaluating small expressions
+// with minilisp_eval and freeing the result, and creating a context.
+// Links the shared library, so it only sees what that exports.
+//
+//   bench/api [seconds per case]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "minilisp.h"
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// ns per evaluation of input, 0 if the result isn't the expected number
+double eval_ns(lenv *e, const char *input, double expect, double seconds) {
+  size_t len = strlen(input);
+  long calls = 0;
+  double start = now(), t;
+  do {
+    for (int i = 0; i < 1000; i++) {
+      lval *v = minilisp_eval(e, input, len);
+      if (minilisp_type(v) != LVAL_NUM || minilisp_number(v) != expect)
+        return 0;
+      minilisp_free(v);
+    }
+    calls += 1000;
+    t = now() - start;
+  } while (t < seconds);
+  return t / calls * 1e9;
+}
+
+int main(int argc, char **argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+  struct { const char *input; double expect; } cases[] = {
+    { "+ 1 2", 3 },
+    { "(* (+ 1 2) (- 10 4) (/ 9 3))", 54 },
+    { "eval (head {(+ 1 2 3 4 5 6 7 8 9 10) 0})", 55 },
+  };
+
+  lenv *e = minilisp_new();
+  for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    double ns = eval_ns(e, cases[i].input, cases[i].expect, seconds);
+    if (ns == 0) {
+      fprintf(stderr, "api: wrong result for %s\n", cases[i].input);
+      return 1;
+    }
+    printf("eval %-40s %8.0f ns/call\n", cases[i].input, ns);
+  }
+  minilisp_delete(e);
+
+  long made = 0;
+  double start = now(), t;
+  do {
+    minilisp_delete(minilisp_new());
+    made++;
+    t = now() - start;
+  } while (t < seconds);
+  printf("%-45s %8.0f ns/call\n", "minilisp_new + minilisp_delete", t / made * 1e9);
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Matrix multiplication throughput in GFLOP/s for square products, on the
+// calling thread alone and split across the task pool.
+//
+//   bench/matmul [workers]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "task.h"
+#include "minilisp_internal.h"
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// the product of a run of at least 0.2s, in GFLOP/s
+double gflops(int n, double *a, double *b, double *c) {
+  int runs = 0;
+  double start = now(), t;
+  do {
+    lmat_mul_parallel(a, b, c, n, n, n);
+    runs++;
+    t = now() - start;
+  } while (t < 0.2);
+  return 2.0 * n * n * n * runs / t / 1e9;
+}
+
+// compare against the textbook loops on a size with ragged edges
+int check() {
+  int n = 67, p = 301, m = 43;
+  double *a = malloc(sizeof(double) * n * p);
+  double *b = malloc(sizeof(double) * p * m);
+  double *c = calloc(n * m, sizeof(double));
+  for (int i = 0; i < n * p; i++)
+    a[i] = (double)rand() / RAND_MAX - 0.5;
+  for (int i = 0; i < p * m; i++)
+    b[i] = (double)rand() / RAND_MAX - 0.5;
+
+  lmat_mul_parallel(a, b, c, n, p, m);
+
+  int ok = 1;
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < m; j++) {
+      double x = 0;
+      for (int k = 0; k < p; k++)
+        x += a[i * p + k] * b[k * m + j];
+      if (fabs(x - c[i * m + j]) > 1e-9)
+        ok = 0;
+    }
+
+  free(a);
+  free(b);
+  free(c);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  int workers = argc > 1 ? atoi(argv[1]) : 0;
+  int sizes[] = { 64, 128, 256, 512, 1024 };
+
+  if (! check()) {
+    fprintf(stderr, "matmul: wrong product\n");
+    return 1;
+  }
+
+  printf("%-6s %12s %12s\n", "n", "1 thread", "pool");
+  for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int n = sizes[s];
+    double *a = malloc(sizeof(double) * n * n);
+    double *b = malloc(sizeof(double) * n * n);
+    double *c = calloc((size_t)n * n, sizeof(double));
+    for (int i = 0; i < n * n; i++) {
+      a[i] = (double)rand() / RAND_MAX;
+      b[i] = (double)rand() / RAND_MAX;
+    }
+
+    double single = gflops(n, a, b, c);
+    task_pool_start(workers);
+    double pool = gflops(n, a, b, c);
+    task_pool_stop();
+    printf("%-6d %12.2f %12.2f\n", n, single, pool);
+
+    free(a);
+    free(b);
+    free(c);
+  }
+  return 0;
+}
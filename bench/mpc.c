@@ -0,0 +1,291 @@
+// Parsing with mpc on its own, away from the minilisp readers.
+//
+// input: a grammar of whitespace separated words over 1 to 100 MB,
+// parsed in place from memory with mpc_parse_n and, at 1 MB, from a file
+// with mpc_parse_file. The string input costs the same per byte at any
+// size.
+//
+// tokens: 1 MB of words 32 to 4096 characters long. From a string a word
+// is matched as a span of the input and copied out once; from a file it
+// is built up a character at a time.
+//
+// packrat: a grammar where every rule tries the same alternative three
+// times, on n nested parentheses. Plain backtracking takes time
+// exponential in n. With mpc_memoize (MPC_LANG_PACKRAT) each rule runs
+// once per position, and what grows faster than n is copying each
+// level's nested tree out of the memo.
+//
+// dispatch: 256 KB of Lisp through the minilisp grammar, where `expr`
+// tries number, symbol, sexpr and qexpr in turn, before and after
+// mpc_analyse lets `or` go straight to the alternative for the next
+// character.
+//
+//   bench/mpc [largest input in megabytes]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mpc.h"
+
+// the library's allocations, counted through the linker's --wrap
+long allocs;
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+void *__wrap_malloc(size_t n) { allocs++; return __real_malloc(n); }
+void *__wrap_calloc(size_t n, size_t size) { allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t n) { allocs++; return __real_realloc(p, n); }
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// words matched so far
+long words;
+
+mpc_val_t *count_word(mpc_val_t *x) {
+  free(x);
+  words++;
+  return NULL;
+}
+
+// a parse of the whole input that keeps no values
+mpc_val_t *fold_none(int n, mpc_val_t **xs) { return NULL; }
+
+// the input of at least size bytes made of copies of unit, and how many
+// words that is
+char *input_of(const char *unit, size_t size, size_t *len, long *count) {
+  size_t n = strlen(unit), copies = (size + n - 1) / n;
+  char *s = malloc(copies * n + 1);
+  for (size_t i = 0; i < copies; i++)
+    memcpy(s + i * n, unit, n);
+  s[copies * n] = '\0';
+  *len = copies * n;
+
+  *count = 0;
+  for (size_t i = 0; i < n; i++)
+    if (unit[i] != ' ' && (i + 1 == n || unit[i + 1] == ' '))
+      (*count)++;
+  *count *= copies;
+  return s;
+}
+
+// parse with p, check that every word was matched and print the time
+void run(const char *row, const char *how, mpc_parser_t *p, const char *s, size_t len, FILE *f, long count) {
+  mpc_result_t r;
+  words = 0;
+  long a = allocs;
+  double start = now();
+  int ok = f ? mpc_parse_file("input", f, p, &r) : mpc_parse_n("input", s, len, p, &r);
+  double t = now() - start;
+  a = allocs - a;
+
+  if (! ok) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    exit(1);
+  }
+  if (words != count) {
+    fprintf(stderr, "mpc: %s matched %ld words instead of %ld\n", how, words, count);
+    exit(1);
+  }
+  double mb = len / 1e6;
+  printf("%-10s %-7s %8.1f MB %8.2f MB/s %8.1f ns/byte %8.2f allocs/byte\n",
+      row, how, mb, mb / t, t * 1e9 / len, (double)a / len);
+}
+
+// whitespace separated words, each folded into a string; parsers find
+// out what they can match as spans when they are defined
+mpc_parser_t *words_new(void) {
+  mpc_parser_t *word = mpc_apply(mpc_many1(mpcf_strfold, mpc_noneof(" ")), count_word);
+  return mpc_define(mpc_new("words"),
+      mpc_and(3, fold_none, mpc_whitespaces(), mpc_many(fold_none, mpc_tok(word)), mpc_eoi(), free, free));
+}
+
+void bench_input(size_t largest) {
+  mpc_parser_t *words = words_new();
+
+  for (size_t mb = 1; mb <= largest; mb *= 10) {
+    size_t len;
+    long count;
+    char *s = input_of("(add 12.5 {x -3 foo} 42) ", mb * 1000000, &len, &count);
+    run("input", "string", words, s, len, NULL, count);
+
+    // the file is read a character at a time, once is enough to compare
+    if (mb == 1) {
+      FILE *f = tmpfile();
+      fwrite(s, 1, len, f);
+      rewind(f);
+      run("input", "file", words, s, len, f, count);
+      fclose(f);
+    }
+    free(s);
+  }
+  mpc_delete(words);
+}
+
+void bench_tokens(void) {
+  mpc_parser_t *words = words_new();
+  for (int n = 32; n <= 4096; n *= 8) {
+    char *unit = malloc(n + 2);
+    memset(unit, 'x', n);
+    strcpy(unit + n, " ");
+    size_t len;
+    long count;
+    char *s = input_of(unit, 1000000, &len, &count);
+    char row[16];
+    snprintf(row, sizeof(row), "tokens%d", n);
+    run(row, "string", words, s, len, NULL, count);
+
+    FILE *f = tmpfile();
+    fwrite(s, 1, len, f);
+    rewind(f);
+    run(row, "file", words, s, len, f, count);
+    fclose(f);
+    free(s);
+    free(unit);
+  }
+  mpc_delete(words);
+}
+
+// the expression grammar, memoized with packrat set
+typedef struct {
+  mpc_parser_t *top, *e, *t;
+} expr_grammar;
+
+void expr_new(expr_grammar *g, int packrat) {
+  g->top = mpc_new("top");
+  g->e = mpc_new("e");
+  g->t = mpc_new("t");
+  mpc_err_t *err = mpca_lang(packrat ? MPC_LANG_PACKRAT : MPC_LANG_DEFAULT,
+      " top : /^/ <e> /$/ ;                              "
+      " e   : <t> '+' <e> | <t> '-' <e> | <t> ;          "
+      " t   : '(' <e> ')' | /[0-9]+/ ;                   ",
+      g->top, g->e, g->t, NULL);
+  if (err) {
+    mpc_err_print(err);
+    exit(1);
+  }
+}
+
+// parse n nested parentheses with g, printing the time
+mpc_ast_t *run_nested(expr_grammar *g, const char *how, int n) {
+  char *s = malloc(2 * n + 2);
+  memset(s, '(', n);
+  s[n] = '1';
+  memset(s + n + 1, ')', n);
+  s[2 * n + 1] = '\0';
+
+  mpc_result_t r;
+  long a = allocs;
+  double start = now();
+  int ok = mpc_parse_n("input", s, 2 * n + 1, g->top, &r);
+  double t = now() - start;
+  a = allocs - a;
+  free(s);
+
+  if (! ok) {
+    mpc_err_print(r.error);
+    exit(1);
+  }
+  char row[16];
+  snprintf(row, sizeof(row), "packrat%d", n);
+  printf("%-10s %-7s %10.2f ms %12ld allocs\n", row, how, t * 1e3, a);
+  return r.output;
+}
+
+void bench_packrat(void) {
+  expr_grammar plain, packrat;
+  expr_new(&plain, 0);
+  expr_new(&packrat, 1);
+
+  for (int n = 2; n <= 10; n += 2) {
+    mpc_ast_t *a = run_nested(&plain, "plain", n);
+    mpc_ast_t *b = run_nested(&packrat, "packrat", n);
+    if (! mpc_ast_eq(a, b)) {
+      fprintf(stderr, "mpc: packrat parsed %d parentheses differently\n", n);
+      exit(1);
+    }
+    mpc_ast_delete(a);
+    mpc_ast_delete(b);
+  }
+  // too deep to wait for without the memo
+  for (int n = 100; n <= 1000; n *= 10)
+    mpc_ast_delete(run_nested(&packrat, "packrat", n));
+
+  mpc_cleanup(3, plain.top, plain.e, plain.t);
+  mpc_cleanup(3, packrat.top, packrat.e, packrat.t);
+}
+
+// parse input with p, printing the time; returns the AST
+mpc_ast_t *run_lisp(mpc_parser_t *p, const char *how, const char *s, size_t len) {
+  mpc_result_t r;
+  long a = allocs;
+  double start = now();
+  int ok = mpc_parse_n("input", s, len, p, &r);
+  double t = now() - start;
+  a = allocs - a;
+
+  if (! ok) {
+    mpc_err_print(r.error);
+    exit(1);
+  }
+  double mb = len / 1e6;
+  printf("%-10s %-7s %8.2f MB %8.2f MB/s %8.1f ns/byte %8.2f allocs/byte\n",
+      "dispatch", how, mb, mb / t, t * 1e9 / len, (double)a / len);
+  return r.output;
+}
+
+void bench_dispatch(void) {
+  mpc_parser_t *number = mpc_new("number");
+  mpc_parser_t *symbol = mpc_new("symbol");
+  mpc_parser_t *sexpr = mpc_new("sexpr");
+  mpc_parser_t *qexpr = mpc_new("qexpr");
+  mpc_parser_t *expr = mpc_new("expr");
+  mpc_parser_t *program = mpc_new("program");
+  mpca_lang(MPC_LANG_DEFAULT,
+      " number  : /-?[0-9]+(\\.[0-9]+)?/ ;               "
+      " symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        "
+      " sexpr   : '(' <expr>* ')' ;                      "
+      " qexpr   : '{' <expr>* '}' ;                      "
+      " expr    : <number> | <symbol> | <sexpr> | <qexpr> ; "
+      " program : /^/ <expr>* /$/ ;                      ",
+      number, symbol, sexpr, qexpr, expr, program, NULL);
+
+  // redefining any analysed parser leaves every grammar without dispatch
+  // until it is analysed again
+  mpc_parser_t *x = mpc_new("x");
+  mpc_define(x, mpc_char('x'));
+  mpc_analyse(x);
+  mpc_define(x, mpc_char('x'));
+
+  size_t len;
+  long count;
+  char *s = input_of("(add 12.5 {x -3 foo} 42) ", 256000, &len, &count);
+  mpc_ast_t *a = run_lisp(program, "plain", s, len);
+  mpc_analyse(program);
+  mpc_ast_t *b = run_lisp(program, "first", s, len);
+  if (! mpc_ast_eq(a, b)) {
+    fprintf(stderr, "mpc: dispatch parsed Lisp differently\n");
+    exit(1);
+  }
+  mpc_ast_delete(a);
+  mpc_ast_delete(b);
+  free(s);
+  mpc_cleanup(7, number, symbol, sexpr, qexpr, expr, program, x);
+}
+
+int main(int argc, char **argv) {
+  size_t largest = argc > 1 ? atol(argv[1]) : 100;
+  bench_input(largest);
+  bench_tokens();
+  bench_packrat();
+  bench_dispatch();
+  return 0;
+}
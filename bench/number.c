@@ -0,0 +1,96 @@
+// Converting number literals: mpc_strtod, which the readers use, against
+// strtod and sscanf("%lf"), on literals the grammar accepts. Every result
+// has to match strtod bit for bit.
+//
+//   bench/number [literals per kind]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mpc.h"
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+double convert_mpc(const char *s, char **end) { return mpc_strtod(s, end); }
+double convert_strtod(const char *s, char **end) { return strtod(s, end); }
+
+double convert_sscanf(const char *s, char **end) {
+  double x;
+  int n = 0;
+  sscanf(s, "%lf%n", &x, &n);
+  *end = (char*)s + n;
+  return x;
+}
+
+struct {
+  const char *name;
+  double (*convert)(const char *s, char **end);
+} converters[] = {
+  { "mpc_strtod", convert_mpc },
+  { "strtod", convert_strtod },
+  { "sscanf", convert_sscanf },
+};
+
+// count literals of one kind, separated by NULs
+char *literals(const char *kind, long count, size_t *size) {
+  char *buf = malloc(count * 32);
+  size_t at = 0;
+  for (long i = 0; i < count; i++) {
+    long r = rand();
+    if (! strcmp(kind, "integers"))
+      at += sprintf(buf + at, "%ld", r % 100000 - 50000);
+    else if (! strcmp(kind, "decimals"))
+      at += sprintf(buf + at, "%ld.%02ld", r % 1000, r / 1000 % 100);
+    else if (! strcmp(kind, "long"))
+      at += sprintf(buf + at, "%.14f", (double)r / RAND_MAX * 1000);
+    else
+      at += sprintf(buf + at, "-%ld.%ld%ld", r % 10, r, r);
+    buf[at++] = '\0';
+  }
+  *size = at;
+  return buf;
+}
+
+int main(int argc, char **argv) {
+  long count = argc > 1 ? atol(argv[1]) : 1000000;
+  const char *kinds[] = { "integers", "decimals", "long", "overlong" };
+  double *expect = malloc(sizeof(double) * count);
+
+  for (int k = 0; k < 4; k++) {
+    size_t size;
+    char *buf = literals(kinds[k], count, &size);
+
+    char *s = buf, *end;
+    for (long i = 0; i < count; i++, s += strlen(s) + 1)
+      expect[i] = strtod(s, &end);
+
+    printf("%-9s", kinds[k]);
+    for (int c = 0; c < 3; c++) {
+      double start = now();
+      s = buf;
+      for (long i = 0; i < count; i++) {
+        double x = converters[c].convert(s, &end);
+        if (memcmp(&x, &expect[i], sizeof(double)) || *end != '\0') {
+          fprintf(stderr, "\nnumber: %s converted %s to %.17g\n", converters[c].name, s, x);
+          return 1;
+        }
+        s = end + 1;
+      }
+      double t = now() - start;
+      printf("  %s %6.1f ns %6.0f MB/s", converters[c].name, t / count * 1e9, size / t / 1e6);
+    }
+    printf("\n");
+    free(buf);
+  }
+
+  free(expect);
+  return 0;
+}
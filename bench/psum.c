@@ -0,0 +1,86 @@
+// Task pool scaling: a recursive parallel sum over an array, split in
+// halves down to a fixed grain, with 1..N workers.
+//
+//   bench/psum [max workers]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "task.h"
+
+#define PSUM_N (1 << 24)
+#define PSUM_GRAIN 4096
+
+typedef struct {
+  double *x;
+  long from, to;
+  double sum;
+} psum;
+
+void psum_run(void *arg) {
+  psum *s = arg;
+  if (s->to - s->from <= PSUM_GRAIN) {
+    double sum = 0;
+    for (long i = s->from; i < s->to; i++)
+      sum += s->x[i];
+    s->sum = sum;
+    return;
+  }
+
+  long mid = s->from + (s->to - s->from) / 2;
+  psum left = { s->x, s->from, mid, 0 };
+  psum right = { s->x, mid, s->to, 0 };
+  task *t = task_spawn(psum_run, &left);
+  psum_run(&right);
+  task_join(t);
+  s->sum = left.sum + right.sum;
+}
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int max = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (max < 1)
+    max = 1;
+
+  double *x = malloc(sizeof(double) * PSUM_N);
+  for (long i = 0; i < PSUM_N; i++)
+    x[i] = i & 0xff;
+  double expect = (double)PSUM_N / 256 * (255 * 256 / 2);
+
+  printf("%-8s %10s %10s %8s\n", "workers", "ms/sum", "tasks/s", "speedup");
+  double base = 0;
+  for (int w = 1; w <= max; w++) {
+    task_pool_start(w);
+    int runs = 0;
+    double start = now(), t;
+    do {
+      psum s = { x, 0, PSUM_N, 0 };
+      task *root = task_spawn(psum_run, &s);
+      task_join(root);
+      if (s.sum != expect) {
+        fprintf(stderr, "psum: wrong sum %f\n", s.sum);
+        return 1;
+      }
+      runs++;
+      t = now() - start;
+    } while (t < 0.5);
+    task_pool_stop();
+
+    double per = t / runs;
+    if (w == 1)
+      base = per;
+    printf("%-8d %10.2f %10.0f %8.2f\n", w, per * 1e3, PSUM_N / PSUM_GRAIN / per, base / per);
+  }
+
+  free(x);
+  return 0;
+}
@@ -0,0 +1,128 @@
+// Reading programs: throughput and allocations per megabyte of input for
+// each of the readers, building an mpc_ast_t first (ast), building lvals
+// while parsing (mpc) and the structural scanner (scan), and for the
+// scanner's first pass alone (index).
+//
+//   bench/read [kilobytes of input for the mpc readers] [megabytes for the scanner]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "minilisp_internal.h"
+
+// the library's allocations, counted through the linker's --wrap
+long allocs;
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+void *__wrap_malloc(size_t n) { allocs++; return __real_malloc(n); }
+void *__wrap_calloc(size_t n, size_t size) { allocs++; return __real_calloc(n, size); }
+void *__wrap_realloc(void *p, size_t n) { allocs++; return __real_realloc(p, n); }
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+typedef struct {
+  const char *name;
+  lval *(*read)(lenv *e, const char *input, size_t len);
+} reader;
+
+lval *read_scan(lenv *e, const char *input, size_t len) { return lscan_read(input, len); }
+
+// an empty list for as many entries as the index got
+lval *read_index(lenv *e, const char *input, size_t len) {
+  return lscan_count(input, len) ? minilisp_eval(e, "{}", 2) : NULL;
+}
+
+reader readers[] = {
+  { "ast", lread_ast },
+  { "mpc", lread_mpc },
+  { "scan", read_scan },
+};
+
+reader index_reader = { "index", read_index };
+
+// what the scanner is run on
+struct {
+  const char *name;
+  const char *unit;
+} inputs[] = {
+  { "program", "(add 12.5 {x -3 foo} 42) " },
+  { "symbols", "(a b c d e f g h) " },
+  { "numbers", "1.25 -3.5 100 " },
+};
+
+// a quoted program of at least size bytes made of copies of unit
+void input_of(lbuf *b, const char *unit, size_t size) {
+  b->len = 0;
+  lbuf_putc(b, '{');
+  while (b->len < size)
+    lbuf_puts(b, unit);
+  lbuf_putc(b, '}');
+}
+
+// read the input with r, printing megabytes per second and allocations
+// per megabyte; returns the value read
+lval *run(lenv *e, const char *input, const char *text, size_t len, reader *r) {
+  long a = allocs;
+  double start = now();
+  lval *v = r->read(e, text, len);
+  double t = now() - start;
+  a = allocs - a;
+
+  if (! v) {
+    fprintf(stderr, "read: %s didn't read %s\n", r->name, input);
+    exit(1);
+  }
+  double mb = len / 1e6;
+  printf("%-10s %-5s %8.1f MB %10.2f MB/s %12.0f allocs/MB\n", input, r->name, mb, mb / t, a / mb);
+  return v;
+}
+
+int main(int argc, char **argv) {
+  size_t size = (argc > 1 ? atol(argv[1]) : 256) * 1000;
+  size_t scan_size = (argc > 2 ? atol(argv[2]) : 16) * 1000000;
+  lenv *e = minilisp_new();
+  lbuf b;
+  lbuf_init(&b, NULL);
+
+  input_of(&b, "(add 12.5 {x -3 foo} 42) ", size);
+  char *first = NULL;
+  for (int i = 0; i < sizeof(readers) / sizeof(readers[0]); i++) {
+    lval *v = run(e, "program", b.data, b.len, &readers[i]);
+    // every reader reads the same
+    char *s = minilisp_format(v);
+    if (first && strcmp(first, s)) {
+      fprintf(stderr, "read: %s read something else\n", readers[i].name);
+      return 1;
+    }
+    if (first)
+      free(s);
+    else
+      first = s;
+    lval_del(v);
+  }
+  free(first);
+
+  // the first pass before any large value is freed, which leaves malloc
+  // with many small chunks to sort through
+  for (int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    input_of(&b, inputs[i].unit, scan_size);
+    lval_del(run(e, inputs[i].name, b.data, b.len, &index_reader));
+  }
+  for (int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+    input_of(&b, inputs[i].unit, scan_size);
+    lval_del(run(e, inputs[i].name, b.data, b.len, &readers[2]));
+  }
+
+  lbuf_free(&b);
+  minilisp_delete(e);
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Round trips of large q-expressions through the binary form
+// (minilisp_serialize/minilisp_deserialize) against printing them and
+// reading the text back.
+//
+//   bench/serial [elements]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "minilisp_internal.h"
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// the time of one call of each of the four directions, as the best of a
+// few runs
+void measure(lenv *e, const char *name, lval *v) {
+  double best[4] = { 1e9, 1e9, 1e9, 1e9 };
+  size_t size = 0, text_len = 0;
+
+  for (int run = 0; run < 5; run++) {
+    double t0 = now();
+    char *data = minilisp_serialize(v, &size);
+    double t1 = now();
+    lval *w = minilisp_deserialize(data, size);
+    double t2 = now();
+    char *text = minilisp_format(v);
+    double t3 = now();
+    text_len = strlen(text);
+    lval *x = minilisp_eval(e, text, text_len);
+    double t4 = now();
+
+    if (! w || minilisp_type(x) != minilisp_type(v)) {
+      fprintf(stderr, "serial: %s doesn't round trip\n", name);
+      exit(1);
+    }
+    double t[4] = { t1 - t0, t2 - t1, t3 - t2, t4 - t3 };
+    for (int i = 0; i < 4; i++)
+      if (t[i] < best[i])
+        best[i] = t[i];
+
+    minilisp_free(w);
+    minilisp_free(x);
+    free(data);
+    free(text);
+  }
+
+  printf("%-8s binary %8.1f MB: write %7.1f ms, read %7.1f ms | text %8.1f MB: print %7.1f ms, read %7.1f ms\n",
+      name, size / 1e6, best[0] * 1e3, best[1] * 1e3, text_len / 1e6, best[2] * 1e3, best[3] * 1e3);
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 200000;
+  lenv *e = minilisp_new();
+
+  // a q-expression of numbers, and one of small lists of symbols, numbers
+  // and strings of digits
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lbuf_putc(&b, '{');
+  for (long i = 0; i < n; i++)
+    lbuf_printf(&b, "%s%.17g", i ? " " : "", (double)rand() / RAND_MAX * 1000);
+  lbuf_putc(&b, '}');
+  lval *numbers = minilisp_eval(e, b.data, b.len);
+
+  b.len = 0;
+  lbuf_putc(&b, '{');
+  for (long i = 0; i < n / 4; i++)
+    lbuf_printf(&b, "{key%ld %ld {x y} %.3f}", i % 100, i, i / 7.0);
+  lbuf_putc(&b, '}');
+  lval *mixed = minilisp_eval(e, b.data, b.len);
+  lbuf_free(&b);
+
+  measure(e, "numbers", numbers);
+  measure(e, "mixed", mixed);
+
+  minilisp_free(numbers);
+  minilisp_free(mixed);
+  minilisp_delete(e);
+  return 0;
+}
@@ -0,0 +1,169 @@
+// Load generator for `prompt --serve`: starts a server on a fresh socket,
+// then clients pipelining a fixed number of requests each keep it busy for
+// a while. Reports requests per second and the latency percentiles.
+//
+//   bench/serve [clients] [pipeline depth] [seconds] [prompt]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define REQUEST "+ 1 (* 2 3) (- 10 4)\n"
+
+char socket_path[64];
+int depth;
+double seconds;
+
+typedef struct {
+  pthread_t thread;
+  double *latencies;
+  long count;
+  long cap;
+  int failed;
+} client;
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int connect_server() {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  // the server may still be starting
+  for (int tries = 0; tries < 500; tries++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+      return fd;
+    close(fd);
+    struct timespec ts = { 0, 10000000 };
+    nanosleep(&ts, NULL);
+  }
+  return -1;
+}
+
+void *client_run(void *arg) {
+  client *c = arg;
+  int fd = connect_server();
+  if (fd < 0) {
+    c->failed = 1;
+    return NULL;
+  }
+
+  double *sent_at = malloc(sizeof(double) * depth);
+  long sent = 0, answered = 0;
+  double end = now() + seconds;
+  char buf[1 << 14];
+
+  while (1) {
+    int sending = now() < end;
+    while (sending && sent - answered < depth) {
+      if (write(fd, REQUEST, strlen(REQUEST)) < 0) {
+        c->failed = 1;
+        goto done;
+      }
+      sent_at[sent++ % depth] = now();
+    }
+    if (! sending && answered == sent)
+      break;
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      c->failed = 1;
+      break;
+    }
+    double t = now();
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i] != '\n')
+        continue;
+      if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1 << 16;
+        c->latencies = realloc(c->latencies, sizeof(double) * c->cap);
+      }
+      c->latencies[c->count++] = t - sent_at[answered++ % depth];
+    }
+  }
+
+done:
+  free(sent_at);
+  close(fd);
+  return NULL;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+  int clients = argc > 1 ? atoi(argv[1]) : 4;
+  depth = argc > 2 ? atoi(argv[2]) : 16;
+  seconds = argc > 3 ? atof(argv[3]) : 2;
+  char *prompt = argc > 4 ? argv[4] : "./prompt";
+  if (clients < 1 || depth < 1 || seconds <= 0) {
+    fprintf(stderr, "usage: bench/serve [clients] [pipeline depth] [seconds] [prompt]\n");
+    return 1;
+  }
+
+  snprintf(socket_path, sizeof(socket_path), "/tmp/minilisp-bench-%d.sock", (int)getpid());
+  pid_t server = fork();
+  if (server == 0) {
+    execl(prompt, prompt, "--serve", socket_path, (char*)NULL);
+    perror(prompt);
+    _exit(1);
+  }
+
+  client *cs = calloc(clients, sizeof(client));
+  double start = now();
+  for (int i = 0; i < clients; i++)
+    pthread_create(&cs[i].thread, NULL, client_run, &cs[i]);
+
+  long total = 0;
+  int failed = 0;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(cs[i].thread, NULL);
+    total += cs[i].count;
+    failed |= cs[i].failed;
+  }
+  double elapsed = now() - start;
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  unlink(socket_path);
+
+  if (failed || total == 0) {
+    fprintf(stderr, "serve: the server didn't answer\n");
+    return 1;
+  }
+
+  double *all = malloc(sizeof(double) * total);
+  long k = 0;
+  for (int i = 0; i < clients; i++) {
+    memcpy(all + k, cs[i].latencies, sizeof(double) * cs[i].count);
+    k += cs[i].count;
+    free(cs[i].latencies);
+  }
+  qsort(all, total, sizeof(double), cmp_double);
+
+  printf("%d clients, depth %d: %ld requests in %.2fs, %.0f req/s, p50 %.1f us, p99 %.1f us\n",
+      clients, depth, total, elapsed, total / elapsed,
+      all[total / 2] * 1e6, all[total * 99 / 100] * 1e6);
+
+  free(all);
+  free(cs);
+  return 0;
+}
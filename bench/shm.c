@@ -0,0 +1,139 @@
+// Latency of `prompt --shm`: starts a server on a fresh shared memory
+// object, then sends requests one at a time and then with the request ring
+// kept full. Reports requests per second and the latency percentiles.
+//
+//   bench/shm [requests] [prompt]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lshm.h"
+
+#define REQUEST "+ 1 (* 2 3) (- 10 4)"
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+lshm_region *attach(char *name) {
+  // the server may still be starting
+  for (int tries = 0; tries < 500; tries++) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd >= 0) {
+      struct stat st;
+      lshm_region *shm = MAP_FAILED;
+      if (fstat(fd, &st) == 0 && st.st_size >= sizeof(lshm_region))
+        shm = mmap(NULL, sizeof(lshm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+      if (shm != MAP_FAILED && atomic_load(&shm->magic) == LSHM_MAGIC)
+        return shm;
+      if (shm != MAP_FAILED)
+        munmap(shm, sizeof(lshm_region));
+    }
+    struct timespec ts = { 0, 10000000 };
+    nanosleep(&ts, NULL);
+  }
+  return NULL;
+}
+
+// keep up to `window` requests in flight, 0 if an answer is wrong
+int run(lshm_region *shm, long n, int window, double *latencies, double *elapsed) {
+  lshm_ring *req = &shm->requests;
+  lshm_ring *res = &shm->responses;
+  double *sent_at = malloc(sizeof(double) * window);
+  unsigned base = atomic_load(&req->head);
+  long sent = 0, answered = 0;
+  int ok = 1;
+
+  double start = now();
+  while (answered < n) {
+    while (sent < n && sent - answered < window) {
+      lshm_slot *s = &req->slots[(base + sent) % LSHM_SLOTS];
+      memcpy(s->data, REQUEST, strlen(REQUEST));
+      s->len = strlen(REQUEST);
+      sent_at[sent % window] = now();
+      atomic_store_explicit(&req->head, base + ++sent, memory_order_release);
+    }
+
+    unsigned tail = atomic_load_explicit(&res->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&res->head, memory_order_acquire) == tail) {
+      // leave the core to the server if it has to share one
+      sched_yield();
+      continue;
+    }
+    lshm_slot *s = &res->slots[tail % LSHM_SLOTS];
+    latencies[answered] = now() - sent_at[answered % window];
+    if (s->len != 3 || memcmp(s->data, "13\n", 3))
+      ok = 0;
+    answered++;
+    atomic_store_explicit(&res->tail, tail + 1, memory_order_release);
+  }
+  *elapsed = now() - start;
+
+  free(sent_at);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 200000;
+  char *prompt = argc > 2 ? argv[2] : "./prompt";
+  if (n < 1) {
+    fprintf(stderr, "usage: bench/shm [requests] [prompt]\n");
+    return 1;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/minilisp-bench-%d", (int)getpid());
+  pid_t server = fork();
+  if (server == 0) {
+    execl(prompt, prompt, "--threads", "1", "--shm", name, (char*)NULL);
+    perror(prompt);
+    _exit(1);
+  }
+
+  lshm_region *shm = attach(name);
+  int status = 0;
+  if (! shm) {
+    fprintf(stderr, "shm: the server didn't start\n");
+    status = 1;
+  }
+
+  int windows[] = { 1, LSHM_SLOTS };
+  double *latencies = malloc(sizeof(double) * n);
+  for (int w = 0; shm && w < 2; w++) {
+    double elapsed;
+    if (! run(shm, n, windows[w], latencies, &elapsed)) {
+      fprintf(stderr, "shm: wrong answer\n");
+      status = 1;
+      break;
+    }
+    qsort(latencies, n, sizeof(double), cmp_double);
+    printf("window %2d: %ld requests in %.2fs, %.0f req/s, p50 %.2f us, p99 %.2f us\n",
+        windows[w], n, elapsed, n / elapsed, latencies[n / 2] * 1e6, latencies[n * 99 / 100] * 1e6);
+  }
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  shm_unlink(name);
+  free(latencies);
+  return status;
+}
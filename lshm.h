@@ -0,0 +1,38 @@
+#ifndef lshm_h
+#define lshm_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Layout of the shared memory object of `prompt --shm NAME`, for callers
+// on the same host. Requests and answers go through two single-producer
+// single-consumer rings. The caller writes the program text into the
+// request slot at `head`, sets the slot's `len` and then bumps `head`; the
+// server copies the text out before it parses it, so the slot is free
+// again as soon as `tail` moves past it. The answer goes into the response
+// slot with the same index, NUL terminated, with its length in `len`. The
+// server sets `magic` once the region is ready.
+#define LSHM_MAGIC 0x6c736d31
+#define LSHM_SLOTS 64
+#define LSHM_SLOT_SIZE 4096
+
+typedef struct {
+  uint32_t len;
+  char data[LSHM_SLOT_SIZE];
+} lshm_slot;
+
+typedef struct {
+  _Alignas(64) atomic_uint head;  // advanced by the producer
+  _Alignas(64) atomic_uint tail;  // advanced by the consumer
+  _Alignas(64) lshm_slot slots[LSHM_SLOTS];
+} lshm_ring;
+
+typedef struct {
+  atomic_uint magic;
+  uint32_t slots;
+  uint32_t slot_size;
+  lshm_ring requests;
+  lshm_ring responses;
+} lshm_region;
+
+#endif
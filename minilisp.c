@@ -0,0 +1,2870 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "mpc.h"
+#include "task.h"
+#include "minilisp_internal.h"
+
+// The grammar is compiled once and then only read while parsing, so any
+// number of interpreter contexts on any threads can share it.
+typedef struct {
+  mpc_parser_t *number, *symbol, *sexpr, *qexpr, *expr, *program;
+
+  // the same grammar building lvals right away, see lread_define
+  mpc_parser_t *read_expr, *read_program;
+} lgrammar;
+
+void lread_define(lgrammar *g);
+
+lgrammar *lgrammar_new() {
+  lgrammar *g = malloc(sizeof(lgrammar));
+  g->number = mpc_new("number");
+  g->symbol = mpc_new("symbol");
+  g->sexpr = mpc_new("sexpr");
+  g->qexpr = mpc_new("qexpr");
+  g->expr = mpc_new("expr");
+  g->program = mpc_new("program");
+
+  // define the grammar for this language
+  mpca_lang(MPC_LANG_DEFAULT,
+      " \
+        number: /-?[0-9]+(\\.[0-9]+)?/ ; \
+        symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
+        sexpr: '(' <expr>* ')' ; \
+        qexpr: '{' <expr>* '}' ; \
+        expr: <number> | <symbol> | <sexpr> | <qexpr> ; \
+        program: /^/ <expr>* /$/ ; \
+      ", g->number, g->symbol, g->sexpr, g->qexpr, g->expr, g->program);
+
+  lread_define(g);
+  return g;
+}
+
+void lgrammar_del(lgrammar *g) {
+  mpc_cleanup(8, g->number, g->symbol, g->sexpr, g->qexpr, g->expr, g->program,
+      g->read_expr, g->read_program);
+  free(g);
+}
+
+// rebuild the grammar from an image written by lgrammar_save, NULL if the
+// image doesn't fit this grammar
+lgrammar *lgrammar_load(const char *image, size_t size) {
+  lgrammar *g = malloc(sizeof(lgrammar));
+  g->number = mpc_new("number");
+  g->symbol = mpc_new("symbol");
+  g->sexpr = mpc_new("sexpr");
+  g->qexpr = mpc_new("qexpr");
+  g->expr = mpc_new("expr");
+  g->program = mpc_new("program");
+
+  if (mpc_image_load(image, size, 6,
+        g->number, g->symbol, g->sexpr, g->qexpr, g->expr, g->program)) {
+    lread_define(g);
+    return g;
+  }
+
+  mpc_cleanup(6, g->number, g->symbol, g->sexpr, g->qexpr, g->expr, g->program);
+  free(g);
+  return NULL;
+}
+
+char *lgrammar_save(lgrammar *g, size_t *size) {
+  return mpc_image_save(size, 6,
+      g->number, g->symbol, g->sexpr, g->qexpr, g->expr, g->program);
+}
+
+// Compiled or loaded from an image by the first context and kept for the
+// life of the process.
+static lgrammar *minilisp_grammar = NULL;
+static pthread_mutex_t minilisp_grammar_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The build normally compiles the grammar once with mkgrammar and embeds
+// the image, so that starting up doesn't run the grammar compiler.
+#ifdef MINILISP_GRAMMAR_IMAGE
+#include "grammar_image.h"
+#else
+static const char *lgrammar_image = NULL;
+static const size_t lgrammar_image_size = 0;
+#endif
+
+// the shared grammar, built from the image if there is none yet
+lgrammar *minilisp_grammar_get(const char *image, size_t size) {
+  pthread_mutex_lock(&minilisp_grammar_lock);
+  if (! minilisp_grammar && image)
+    minilisp_grammar = lgrammar_load(image, size);
+  if (! minilisp_grammar && lgrammar_image_size)
+    minilisp_grammar = lgrammar_load((const char*)lgrammar_image, lgrammar_image_size);
+  // without an image, or with one that doesn't fit
+  if (! minilisp_grammar)
+    minilisp_grammar = lgrammar_new();
+  lgrammar *g = minilisp_grammar;
+  pthread_mutex_unlock(&minilisp_grammar_lock);
+  return g;
+}
+
+// An interpreter context: the shared grammar, the builtin functions by
+// name, settings and statistics. Evaluation only touches the context it
+// is given, so independent contexts can run on different threads at once.
+//
+// lvals still come from the per-thread free lists below rather than from
+// the context: pmap and parallel arguments build lvals on one worker and
+// free them on another, which a per-context list could only allow with a
+// lock.
+struct lenv {
+  lgrammar *grammar;
+
+  int count;
+  char **syms;
+  lbuiltin *funs;
+
+  // s-expression arguments with at least this many nodes are evaluated
+  // as tasks of their own, 0 disables it
+  int parallel_threshold;
+
+  // how much of each result eval_print writes
+  lprint_limits print_limits;
+
+  // updated by every thread evaluating in the context
+  atomic_long exprs;
+  atomic_long errors;
+};
+
+// Freed lvals are kept on a per-thread free list and reused by the
+// factories, so threads evaluating in parallel don't contend on malloc.
+// The list goes back to malloc when its thread exits, through the
+// destructor of a thread-specific key, or for the thread calling exit.
+#define LVAL_CACHE_MAX 4096
+
+static _Thread_local lval *lval_cache = NULL;
+static _Thread_local int lval_cache_num = 0;
+static _Thread_local int lval_cache_registered = 0;
+
+static pthread_key_t lval_cache_key;
+static pthread_once_t lval_cache_once = PTHREAD_ONCE_INIT;
+
+void lval_cache_flush(void) {
+  while (lval_cache) {
+    lval *v = lval_cache;
+    lval_cache = v->next;
+    free(v);
+  }
+  lval_cache_num = 0;
+}
+
+void lval_cache_exit(void *unused) {
+  (void)unused;
+  lval_cache_flush();
+}
+
+void lval_cache_init(void) {
+  pthread_key_create(&lval_cache_key, lval_cache_exit);
+  atexit(lval_cache_flush);
+}
+
+lval *lval_alloc() {
+  lval *v = lval_cache;
+  if (! v)
+    return malloc(sizeof(lval));
+
+  lval_cache = v->next;
+  lval_cache_num--;
+  return v;
+}
+
+void lval_free(lval *v) {
+  if (lval_cache_num >= LVAL_CACHE_MAX) {
+    free(v);
+    return;
+  }
+
+  // the key's destructor only runs for threads that set a value
+  if (! lval_cache_registered) {
+    pthread_once(&lval_cache_once, lval_cache_init);
+    pthread_setspecific(lval_cache_key, &lval_cache_registered);
+    lval_cache_registered = 1;
+  }
+
+  v->next = lval_cache;
+  lval_cache = v;
+  lval_cache_num++;
+}
+
+// number factory
+lval *lval_num(double x) {
+  lval *v = lval_alloc();
+  v->type = LVAL_NUM;
+  v->count = 0;
+  v->num = x;
+  return v;
+}
+
+// error factory
+lval *lval_err(char *m) {
+  lval *v = lval_alloc();
+  v->type = LVAL_ERR;
+  v->count = 0;
+  v->err = malloc(strlen(m) + 1);
+  strcpy(v->err, m);
+  return v;
+}
+
+// symbol factory
+lval *lval_sym(char *s) {
+  lval *v = lval_alloc();
+  v->type = LVAL_SYM;
+  v->count = 0;
+  v->sym = malloc(strlen(s) + 1);
+  strcpy(v->sym, s);
+  return v;
+}
+
+// function factory
+lval *lval_fun(lbuiltin f) {
+  lval *v = lval_alloc();
+  v->type = LVAL_FUN;
+  v->count = 0;
+  v->fun = f;
+  return v;
+}
+
+// s-expr factory
+lval *lval_sexpr() {
+  lval *v = lval_alloc();
+  v->type = LVAL_SEXPR;
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+// q-expr factory
+lval *lval_qexpr() {
+  lval *v = lval_alloc();
+  v->type = LVAL_QEXPR;
+  v->count = 0;
+  v->cell = NULL;
+  return v;
+}
+
+// matrix factory, the elements are zeroed
+lval *lval_mat(int rows, int cols) {
+  lval *v = lval_alloc();
+  v->type = LVAL_MAT;
+  v->count = 0;
+  v->rows = rows;
+  v->cols = cols;
+  v->mat = calloc((size_t)rows * cols + 1, sizeof(double));
+  return v;
+}
+
+// Elements waiting to be freed are chained through `next` instead of
+// recursing into lists, so values nested any deep can be freed.
+void lval_del(lval *v) {
+  v->next = NULL;
+  while (v) {
+    lval *next = v->next;
+    switch (v->type) {
+      case LVAL_NUM: break;
+      case LVAL_ERR: free(v->err); break;
+      case LVAL_SYM: free(v->sym); break;
+      case LVAL_FUN: break;
+      case LVAL_MAT: free(v->mat); break;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+        for (int i = 0; i < v->count; i++) {
+          v->cell[i]->next = next;
+          next = v->cell[i];
+        }
+
+        free(v->cell);
+        break;
+    }
+
+    lval_free(v);
+    v = next;
+  }
+}
+
+// add a new element x to v's list
+lval *lval_add(lval *v, lval *x) {
+  v->count++;
+  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell[v->count - 1] = x;
+  return v;
+}
+
+lval *lval_pop(lval *v, int i) {
+  lval *x = v->cell[i];
+
+  // shift the array inplace removing a reference to i-th element
+  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count-i-1));
+
+  // decrease the count
+  v->count--;
+
+  // reallocate the memory used (as we removed one element)
+  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  return x;
+}
+
+lval *lval_take(lval *v, int i) {
+  lval* x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+lval *lval_join(lval *x, lval *y) {
+  // one by one put elements from y to x
+  while (y->count > 0)
+    x = lval_add(x, lval_pop(y, 0));
+  lval_del(y);
+  return x;
+}
+
+// deep copy of the value passed in
+lval *lval_copy(lval *x) {
+  lval *c = lval_alloc();
+  c->type = x->type;
+
+  switch (x->type) {
+    case LVAL_NUM:
+      c->num = x->num; break;
+    case LVAL_ERR:
+      c->err = malloc(strlen(x->err) + 1);
+      strcpy(c->err, x->err);
+      break;
+    case LVAL_SYM:
+      c->sym = malloc(strlen(x->sym) + 1);
+      strcpy(c->sym, x->sym);
+      break;
+    case LVAL_FUN:
+      c->fun = x->fun; break;
+    case LVAL_MAT:
+      c->count = 0;
+      c->rows = x->rows;
+      c->cols = x->cols;
+      c->mat = malloc(sizeof(double) * ((size_t)x->rows * x->cols + 1));
+      memcpy(c->mat, x->mat, sizeof(double) * x->rows * x->cols);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      c->count = x->count;
+      c->cell = malloc(sizeof(lval*) * c->count);
+      for (int i = 0; i < x->count; i++)
+        c->cell[i] = lval_copy(x->cell[i]);
+      break;
+  }
+
+  return c;
+}
+
+lval *lval_read_num_str(char *s) {
+  char *end;
+  double x = mpc_strtod(s, &end);
+  return end != s ? lval_num(x) : lval_err("Invalid number.");
+}
+
+lval *lval_read_num(mpc_ast_t *t) {
+  return lval_read_num_str(t->contents);
+}
+
+lval *lval_read(mpc_ast_t* t) {
+  // for atoms, like numbers or symbols, just create a val of this type
+  if (strstr(t->tag, "number")) { return lval_read_num(t); }
+  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+
+  // otherwise it is either root or sexpr for s-expression
+  lval* x = NULL;
+  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
+  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+
+  // recursively add valid expressions of s-expression
+  for (int i = 0; i < t->children_num; i++) {
+    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+
+  return x;
+}
+
+// The reader grammar builds lvals while parsing instead of an mpc_ast_t to
+// be walked by lval_read afterwards. It is put together from combinators
+// rather than through mpca_lang, and accepts exactly what the grammar
+// above does: tokens skip the whitespace after them and a number is tried
+// before a symbol. It has no useful error messages of its own, so on a
+// parse error the input is parsed again with the regular grammar.
+mpc_val_t *lread_num(mpc_val_t *x) {
+  lval *v = lval_read_num_str(x);
+  free(x);
+  return v;
+}
+
+mpc_val_t *lread_sym(mpc_val_t *x) {
+  // the string becomes the symbol as it is
+  lval *v = lval_alloc();
+  v->type = LVAL_SYM;
+  v->count = 0;
+  v->sym = x;
+  return v;
+}
+
+// collect the expressions of a list into an s-expression
+mpc_val_t *lread_list(int n, mpc_val_t **xs) {
+  lval *v = lval_sexpr();
+  if (n == 0)
+    return v;
+  v->cell = malloc(sizeof(lval*) * n);
+  memcpy(v->cell, xs, sizeof(lval*) * n);
+  v->count = n;
+  return v;
+}
+
+// the list between the brackets
+mpc_val_t *lread_sexpr(int n, mpc_val_t **xs) {
+  free(xs[0]);
+  free(xs[2]);
+  return xs[1];
+}
+
+mpc_val_t *lread_qexpr(int n, mpc_val_t **xs) {
+  lval *v = lread_sexpr(n, xs);
+  v->type = LVAL_QEXPR;
+  return v;
+}
+
+void lread_del(mpc_val_t *x) { lval_del(x); }
+
+void lread_define(lgrammar *g) {
+  // -?[0-9]+(\.[0-9]+)?
+  mpc_parser_t *number = mpc_and(3, mpcf_strfold,
+      mpc_maybe_lift(mpc_char('-'), mpcf_ctor_str),
+      mpc_digits(),
+      mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str),
+      free, free);
+
+  // [a-zA-Z0-9_+\-*\/\\=<>!&]+
+  mpc_parser_t *symbol = mpc_many1(mpcf_strfold,
+      mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-*/\\=<>!&"));
+
+  g->read_expr = mpc_new("read_expr");
+  g->read_program = mpc_new("read_program");
+
+  mpc_define(g->read_expr, mpc_or(4,
+      mpc_apply(mpc_tok(number), lread_num),
+      mpc_apply(mpc_tok(symbol), lread_sym),
+      mpc_and(3, lread_sexpr, mpc_tok(mpc_char('(')),
+        mpc_many(lread_list, g->read_expr), mpc_tok(mpc_char(')')), free, lread_del),
+      mpc_and(3, lread_qexpr, mpc_tok(mpc_char('{')),
+        mpc_many(lread_list, g->read_expr), mpc_tok(mpc_char('}')), free, lread_del)));
+
+  mpc_define(g->read_program, mpc_and(3, lread_sexpr,
+      mpc_tok(mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free)),
+      mpc_many(lread_list, g->read_expr),
+      mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free),
+      free, lread_del));
+
+  // lets read_expr go straight to the alternative for the next character
+  mpc_analyse(g->read_program);
+}
+
+// Reading large inputs a character at a time through mpc is slow, so
+// programs are first read by a scanner in two passes: the first one finds
+// the brackets and the start of every token and puts their offsets into
+// an index, the second one builds the lvals from the index. The first
+// pass classifies 64 bytes at a time into bitmasks, with SSE2 where
+// available. The scanner accepts exactly the grammar; anything else is
+// left to mpc, which also reports the error.
+enum { LSCAN_BLOCK = 64 };
+
+typedef struct {
+  size_t *pos;
+  size_t count;
+  size_t cap;
+} lscan_index;
+
+// bitmasks of the brackets and of the whitespace in 64 bytes at s
+void lscan_classify(const char *s, uint64_t *brackets, uint64_t *space) {
+#ifdef __SSE2__
+  uint64_t b = 0, w = 0;
+  for (int i = 0; i < LSCAN_BLOCK; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i br = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('(')), _mm_cmpeq_epi8(x, _mm_set1_epi8(')'))),
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('{')), _mm_cmpeq_epi8(x, _mm_set1_epi8('}'))));
+    // ' ' and '\t' to '\r'
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+        _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('\r' + 1))));
+    b |= (uint64_t)(uint16_t)_mm_movemask_epi8(br) << i;
+    w |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << i;
+  }
+  *brackets = b;
+  *space = w;
+#else
+  uint64_t b = 0, w = 0;
+  for (int i = 0; i < LSCAN_BLOCK; i++) {
+    char c = s[i];
+    if (c == '(' || c == ')' || c == '{' || c == '}')
+      b |= (uint64_t)1 << i;
+    else if (c == ' ' || (c >= '\t' && c <= '\r'))
+      w |= (uint64_t)1 << i;
+  }
+  *brackets = b;
+  *space = w;
+#endif
+}
+
+// room for the offsets of another block
+void lscan_reserve(lscan_index *x) {
+  if (x->cap - x->count < LSCAN_BLOCK) {
+    x->cap = x->cap ? x->cap * 2 : 1024;
+    x->pos = realloc(x->pos, sizeof(size_t) * x->cap);
+  }
+}
+
+// the first pass: offsets of the brackets and token starts in s[0..len)
+void lscan_index_build(lscan_index *x, const char *s, size_t len) {
+  char tail[LSCAN_BLOCK];
+  // whether the byte before the block ended a token
+  uint64_t carry = 1;
+
+  for (size_t at = 0; at < len; at += LSCAN_BLOCK) {
+    const char *block = s + at;
+    if (len - at < LSCAN_BLOCK) {
+      // pad the last block with whitespace
+      memset(tail, ' ', LSCAN_BLOCK);
+      memcpy(tail, block, len - at);
+      block = tail;
+    }
+
+    uint64_t brackets, space;
+    lscan_classify(block, &brackets, &space);
+
+    // a token starts where a byte that isn't a bracket or whitespace
+    // follows one that is
+    uint64_t token = ~(brackets | space);
+    uint64_t starts = token & ~((token << 1) | (carry ^ 1));
+    carry = (token >> (LSCAN_BLOCK - 1)) ^ 1;
+
+    lscan_reserve(x);
+    for (uint64_t m = brackets | starts; m; m &= m - 1)
+      x->pos[x->count++] = at + __builtin_ctzll(m);
+  }
+}
+
+size_t lscan_count(const char *s, size_t len) {
+  lscan_index x = {NULL, 0, 0};
+  lscan_index_build(&x, s, len);
+  free(x.pos);
+  return x.count;
+}
+
+int lscan_symbol_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+    || (c != '\0' && strchr("_+-*/\\=<>!&", c) != NULL);
+}
+
+// length of the number at s[0..n), as /-?[0-9]+(\.[0-9]+)?/ matches it
+size_t lscan_number(const char *s, size_t n) {
+  size_t i = 0;
+  if (i < n && s[i] == '-')
+    i++;
+  size_t digits = i;
+  while (i < n && s[i] >= '0' && s[i] <= '9')
+    i++;
+  if (i == digits)
+    return 0;
+  if (i + 1 < n && s[i] == '.' && s[i + 1] >= '0' && s[i + 1] <= '9') {
+    i++;
+    while (i < n && s[i] >= '0' && s[i] <= '9')
+      i++;
+  }
+  return i;
+}
+
+lval *lscan_num(const char *s, size_t n) {
+  char small[64];
+  char *buf = n < sizeof(small) ? small : malloc(n + 1);
+  memcpy(buf, s, n);
+  buf[n] = '\0';
+  lval *v = lval_read_num_str(buf);
+  if (buf != small)
+    free(buf);
+  return v;
+}
+
+lval *lscan_sym(const char *s, size_t n) {
+  lval *v = lval_alloc();
+  v->type = LVAL_SYM;
+  v->count = 0;
+  v->sym = malloc(n + 1);
+  memcpy(v->sym, s, n);
+  v->sym[n] = '\0';
+  return v;
+}
+
+// Values read so far. The elements of the lists still open are on top of
+// each other, and a list takes its elements off the stack when it closes.
+typedef struct {
+  lval **vals;
+  size_t count;
+  size_t cap;
+} lscan_stack;
+
+void lscan_stack_push(lscan_stack *st, lval *v) {
+  if (st->count == st->cap) {
+    st->cap = st->cap ? st->cap * 2 : 256;
+    st->vals = realloc(st->vals, sizeof(lval*) * st->cap);
+  }
+  st->vals[st->count++] = v;
+}
+
+// a list of the values from start up on the stack
+lval *lscan_list(lscan_stack *st, size_t start, int type) {
+  lval *v = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+  size_t n = st->count - start;
+  if (n > 0) {
+    v->cell = malloc(sizeof(lval*) * n);
+    memcpy(v->cell, st->vals + start, sizeof(lval*) * n);
+    v->count = n;
+  }
+  st->count = start;
+  return v;
+}
+
+// split the token at s into numbers and symbols like the grammar does,
+// 0 if it isn't made of them
+int lscan_token(lscan_stack *st, const char *s, const char *end) {
+  while (s < end) {
+    size_t n = lscan_number(s, end - s);
+    if (n > 0) {
+      lscan_stack_push(st, lscan_num(s, n));
+      s += n;
+      continue;
+    }
+    while (s + n < end && lscan_symbol_char(s[n]))
+      n++;
+    if (n == 0)
+      return 0;
+    lscan_stack_push(st, lscan_sym(s, n));
+    s += n;
+  }
+  return 1;
+}
+
+// the program in s[0..len) as an s-expression, NULL if it doesn't follow
+// the grammar
+lval *lscan_read(const char *s, size_t len) {
+  lscan_index x = {NULL, 0, 0};
+  lscan_index_build(&x, s, len);
+
+  lscan_stack st = {NULL, 0, 0};
+  // where the elements of each open list start and the closing bracket
+  size_t *open = NULL;
+  char *close = NULL;
+  size_t depth = 0, open_cap = 0;
+  int ok = 1;
+
+  for (size_t i = 0; ok && i < x.count; i++) {
+    const char *p = s + x.pos[i];
+    switch (*p) {
+      case '(':
+      case '{':
+        if (depth == open_cap) {
+          open_cap = open_cap ? open_cap * 2 : 64;
+          open = realloc(open, sizeof(size_t) * open_cap);
+          close = realloc(close, open_cap);
+        }
+        open[depth] = st.count;
+        close[depth] = *p == '(' ? ')' : '}';
+        depth++;
+        break;
+      case ')':
+      case '}':
+        if (depth == 0 || close[depth - 1] != *p) {
+          ok = 0;
+          break;
+        }
+        depth--;
+        lscan_stack_push(&st, lscan_list(&st, open[depth], *p == ')' ? LVAL_SEXPR : LVAL_QEXPR));
+        break;
+      default: {
+        // the token ends at the next bracket or whitespace
+        const char *end = i + 1 < x.count ? s + x.pos[i + 1] : s + len;
+        const char *q = p;
+        while (q < end && *q != ' ' && (*q < '\t' || *q > '\r'))
+          q++;
+        ok = lscan_token(&st, p, q);
+      }
+    }
+  }
+
+  lval *v = NULL;
+  if (ok && depth == 0)
+    v = lscan_list(&st, 0, LVAL_SEXPR);
+
+  for (size_t i = 0; i < st.count; i++)
+    lval_del(st.vals[i]);
+  free(st.vals);
+  free(open);
+  free(close);
+  free(x.pos);
+  return v;
+}
+
+lval *lread_ast(lenv *e, const char *input, size_t len) {
+  mpc_result_t r;
+  if (! mpc_parse_n("<input>", input, len, e->grammar->program, &r)) {
+    mpc_err_delete(r.error);
+    return NULL;
+  }
+  lval *v = lval_read(r.output);
+  mpc_ast_delete(r.output);
+  return v;
+}
+
+lval *lread_mpc(lenv *e, const char *input, size_t len) {
+  mpc_result_t r;
+  if (! mpc_parse_n("<input>", input, len, e->grammar->read_program, &r)) {
+    mpc_err_delete(r.error);
+    return NULL;
+  }
+  return r.output;
+}
+
+// buffers attached to a stream write themselves out once this full
+#define LBUF_FLUSH (1 << 16)
+
+void lbuf_init(lbuf *b, FILE *out) {
+  b->data = NULL;
+  b->len = 0;
+  b->flushed = 0;
+  b->cap = 0;
+  b->out = out;
+}
+
+void lbuf_free(lbuf *b) {
+  free(b->data);
+  lbuf_init(b, NULL);
+}
+
+void lbuf_flush(lbuf *b) {
+  if (b->out && b->len) {
+    fwrite(b->data, 1, b->len, b->out);
+    b->flushed += b->len;
+    b->len = 0;
+  }
+}
+
+// make room for n more bytes and a terminating NUL
+void lbuf_reserve(lbuf *b, size_t n) {
+  if (b->len + n + 1 <= b->cap)
+    return;
+  while (b->len + n + 1 > b->cap)
+    b->cap = b->cap ? b->cap * 2 : 256;
+  b->data = realloc(b->data, b->cap);
+}
+
+void lbuf_write(lbuf *b, const char *s, size_t n) {
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  b->data[b->len] = '\0';
+  if (b->out && b->len >= LBUF_FLUSH)
+    lbuf_flush(b);
+}
+
+void lbuf_putc(lbuf *b, char c) {
+  lbuf_reserve(b, 1);
+  b->data[b->len++] = c;
+  b->data[b->len] = '\0';
+  if (b->out && b->len >= LBUF_FLUSH)
+    lbuf_flush(b);
+}
+void lbuf_puts(lbuf *b, const char *s) { lbuf_write(b, s, strlen(s)); }
+
+void lbuf_printf(lbuf *b, const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int n = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+
+  lbuf_reserve(b, n);
+  va_start(va, fmt);
+  vsnprintf(b->data + b->len, n + 1, fmt, va);
+  va_end(va);
+
+  b->len += n;
+  if (b->out && b->len >= LBUF_FLUSH)
+    lbuf_flush(b);
+}
+
+// Numbers print as the shortest decimal that reads back as the same
+// double, always in the plain notation the grammar accepts.
+
+static const double lnum_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// the digits of m into s, returns their count
+int lnum_uint(char *s, uint64_t m) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + m % 10;
+    m /= 10;
+  } while (m);
+  for (int i = 0; i < n; i++)
+    s[i] = tmp[n - 1 - i];
+  return n;
+}
+
+// Shortest digits of positive finite x are found with Grisu3 (Loitsch,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers"):
+// x and the bounds of the interval of numbers that read back as x are
+// scaled by a cached power of ten into 64 bit fixed point, and digits are
+// generated until they fall inside the interval. The arithmetic is
+// inexact by a few units, so for the rare x where that could change the
+// outcome Grisu3 gives up and the digits are searched exactly instead.
+typedef struct {
+  uint64_t f;
+  int e;
+} lfp;
+
+// 10^k for k = -348, -340, ..., 340 as 64 bit significands rounded to
+// nearest and binary exponents
+static const struct {
+  uint64_t f;
+  short e;
+  short k;
+} lfp_pow10[] = {
+  { 0xfa8fd5a0081c0288ull, -1220, -348 },
+  { 0xbaaee17fa23ebf76ull, -1193, -340 },
+  { 0x8b16fb203055ac76ull, -1166, -332 },
+  { 0xcf42894a5dce35eaull, -1140, -324 },
+  { 0x9a6bb0aa55653b2dull, -1113, -316 },
+  { 0xe61acf033d1a45dfull, -1087, -308 },
+  { 0xab70fe17c79ac6caull, -1060, -300 },
+  { 0xff77b1fcbebcdc4full, -1034, -292 },
+  { 0xbe5691ef416bd60cull, -1007, -284 },
+  { 0x8dd01fad907ffc3cull, -980, -276 },
+  { 0xd3515c2831559a83ull, -954, -268 },
+  { 0x9d71ac8fada6c9b5ull, -927, -260 },
+  { 0xea9c227723ee8bcbull, -901, -252 },
+  { 0xaecc49914078536dull, -874, -244 },
+  { 0x823c12795db6ce57ull, -847, -236 },
+  { 0xc21094364dfb5637ull, -821, -228 },
+  { 0x9096ea6f3848984full, -794, -220 },
+  { 0xd77485cb25823ac7ull, -768, -212 },
+  { 0xa086cfcd97bf97f4ull, -741, -204 },
+  { 0xef340a98172aace5ull, -715, -196 },
+  { 0xb23867fb2a35b28eull, -688, -188 },
+  { 0x84c8d4dfd2c63f3bull, -661, -180 },
+  { 0xc5dd44271ad3cdbaull, -635, -172 },
+  { 0x936b9fcebb25c996ull, -608, -164 },
+  { 0xdbac6c247d62a584ull, -582, -156 },
+  { 0xa3ab66580d5fdaf6ull, -555, -148 },
+  { 0xf3e2f893dec3f126ull, -529, -140 },
+  { 0xb5b5ada8aaff80b8ull, -502, -132 },
+  { 0x87625f056c7c4a8bull, -475, -124 },
+  { 0xc9bcff6034c13053ull, -449, -116 },
+  { 0x964e858c91ba2655ull, -422, -108 },
+  { 0xdff9772470297ebdull, -396, -100 },
+  { 0xa6dfbd9fb8e5b88full, -369, -92 },
+  { 0xf8a95fcf88747d94ull, -343, -84 },
+  { 0xb94470938fa89bcfull, -316, -76 },
+  { 0x8a08f0f8bf0f156bull, -289, -68 },
+  { 0xcdb02555653131b6ull, -263, -60 },
+  { 0x993fe2c6d07b7facull, -236, -52 },
+  { 0xe45c10c42a2b3b06ull, -210, -44 },
+  { 0xaa242499697392d3ull, -183, -36 },
+  { 0xfd87b5f28300ca0eull, -157, -28 },
+  { 0xbce5086492111aebull, -130, -20 },
+  { 0x8cbccc096f5088ccull, -103, -12 },
+  { 0xd1b71758e219652cull, -77, -4 },
+  { 0x9c40000000000000ull, -50, 4 },
+  { 0xe8d4a51000000000ull, -24, 12 },
+  { 0xad78ebc5ac620000ull, 3, 20 },
+  { 0x813f3978f8940984ull, 30, 28 },
+  { 0xc097ce7bc90715b3ull, 56, 36 },
+  { 0x8f7e32ce7bea5c70ull, 83, 44 },
+  { 0xd5d238a4abe98068ull, 109, 52 },
+  { 0x9f4f2726179a2245ull, 136, 60 },
+  { 0xed63a231d4c4fb27ull, 162, 68 },
+  { 0xb0de65388cc8ada8ull, 189, 76 },
+  { 0x83c7088e1aab65dbull, 216, 84 },
+  { 0xc45d1df942711d9aull, 242, 92 },
+  { 0x924d692ca61be758ull, 269, 100 },
+  { 0xda01ee641a708deaull, 295, 108 },
+  { 0xa26da3999aef774aull, 322, 116 },
+  { 0xf209787bb47d6b85ull, 348, 124 },
+  { 0xb454e4a179dd1877ull, 375, 132 },
+  { 0x865b86925b9bc5c2ull, 402, 140 },
+  { 0xc83553c5c8965d3dull, 428, 148 },
+  { 0x952ab45cfa97a0b3ull, 455, 156 },
+  { 0xde469fbd99a05fe3ull, 481, 164 },
+  { 0xa59bc234db398c25ull, 508, 172 },
+  { 0xf6c69a72a3989f5cull, 534, 180 },
+  { 0xb7dcbf5354e9beceull, 561, 188 },
+  { 0x88fcf317f22241e2ull, 588, 196 },
+  { 0xcc20ce9bd35c78a5ull, 614, 204 },
+  { 0x98165af37b2153dfull, 641, 212 },
+  { 0xe2a0b5dc971f303aull, 667, 220 },
+  { 0xa8d9d1535ce3b396ull, 694, 228 },
+  { 0xfb9b7cd9a4a7443cull, 720, 236 },
+  { 0xbb764c4ca7a44410ull, 747, 244 },
+  { 0x8bab8eefb6409c1aull, 774, 252 },
+  { 0xd01fef10a657842cull, 800, 260 },
+  { 0x9b10a4e5e9913129ull, 827, 268 },
+  { 0xe7109bfba19c0c9dull, 853, 276 },
+  { 0xac2820d9623bf429ull, 880, 284 },
+  { 0x80444b5e7aa7cf85ull, 907, 292 },
+  { 0xbf21e44003acdd2dull, 933, 300 },
+  { 0x8e679c2f5e44ff8full, 960, 308 },
+  { 0xd433179d9c8cb841ull, 986, 316 },
+  { 0x9e19db92b4e31ba9ull, 1013, 324 },
+  { 0xeb96bf6ebadf77d9ull, 1039, 332 },
+  { 0xaf87023b9bf0ee6bull, 1066, 340 },
+};
+
+static const uint32_t lfp_small_pow10[] = {
+  0, 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+lfp lfp_normalize(lfp x) {
+  int shift = __builtin_clzll(x.f);
+  x.f <<= shift;
+  x.e -= shift;
+  return x;
+}
+
+// the upper 64 bits of the product, rounded
+lfp lfp_mul(lfp x, lfp y) {
+  uint64_t a = x.f >> 32, b = x.f & 0xffffffff, c = y.f >> 32, d = y.f & 0xffffffff;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff) + (1u << 31);
+  lfp r = { ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+  return r;
+}
+
+// Move the last digit down while that brings it closer to x, then check
+// that the digits are safely inside the interval and the closest ones;
+// 0 if that can't be told.
+int lgrisu_round(char *d, int n, uint64_t too_high_w, uint64_t unsafe,
+    uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+  uint64_t small = too_high_w - unit, big = too_high_w + unit;
+  while (rest < small && unsafe - rest >= ten_kappa &&
+      (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small)) {
+    d[n - 1]--;
+    rest += ten_kappa;
+  }
+  if (rest < big && unsafe - rest >= ten_kappa &&
+      (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+    return 0;
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+// digits of the scaled w between low and high, *kappa is the power of ten
+// of the last one; 0 if Grisu3 gives up
+int lgrisu_digits(lfp low, lfp w, lfp high, char *d, int *n, int *kappa) {
+  uint64_t unit = 1;
+  lfp too_low = { low.f - unit, low.e }, too_high = { high.f + unit, high.e };
+  uint64_t unsafe = too_high.f - too_low.f;
+  int shift = -w.e;
+  uint64_t one = (uint64_t)1 << shift;
+  uint32_t integrals = too_high.f >> shift;
+  uint64_t fractionals = too_high.f & (one - 1);
+
+  // the largest power of ten that is at most integrals
+  int k = ((64 - shift + 1) * 1233 >> 12) + 1;
+  if (integrals < lfp_small_pow10[k])
+    k--;
+  uint32_t divisor = lfp_small_pow10[k];
+
+  *n = 0;
+  *kappa = k;
+  while (*kappa > 0) {
+    d[(*n)++] = '0' + integrals / divisor;
+    integrals %= divisor;
+    (*kappa)--;
+    uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+    if (rest < unsafe)
+      return lgrisu_round(d, *n, too_high.f - w.f, unsafe, rest, (uint64_t)divisor << shift, unit);
+    divisor /= 10;
+  }
+
+  while (1) {
+    fractionals *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    d[(*n)++] = '0' + (fractionals >> shift);
+    fractionals &= one - 1;
+    (*kappa)--;
+    if (fractionals < unsafe)
+      return lgrisu_round(d, *n, (too_high.f - w.f) * unit, unsafe, fractionals, one, unit);
+  }
+}
+
+// x = digits * 10^*exp with the fewest digits, 0 if Grisu3 gives up
+int lgrisu(double x, char *digits, int *n, int *exp) {
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  uint64_t hidden = (uint64_t)1 << 52;
+  int biased = (bits >> 52) & 0x7ff;
+  lfp v = { bits & (hidden - 1), -1074 };
+  if (biased) {
+    v.f |= hidden;
+    v.e = biased - 1075;
+  }
+
+  // the interval halfway to the neighbouring doubles, which is narrower
+  // below powers of two
+  lfp plus = lfp_normalize((lfp){ (v.f << 1) + 1, v.e - 1 });
+  lfp minus = v.f == hidden && biased > 1 ? (lfp){ (v.f << 2) - 1, v.e - 2 } : (lfp){ (v.f << 1) - 1, v.e - 1 };
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+  lfp w = lfp_normalize(v);
+
+  // a power of ten that brings the exponent of w into [-60, -32]
+  int k = (int)ceil((-60 - (w.e + 64) + 64 - 1) * 0.30102999566398114);
+  int i = (348 + k - 1) / 8 + 1;
+  lfp c = { lfp_pow10[i].f, lfp_pow10[i].e };
+
+  int kappa;
+  if (! lgrisu_digits(lfp_mul(minus, c), lfp_mul(w, c), lfp_mul(plus, c), digits, n, &kappa))
+    return 0;
+  *exp = kappa - lfp_pow10[i].k;
+  return 1;
+}
+
+// Shortest digits of positive finite x and the exponent of the first one,
+// so that x = d.ddd * 10^exp.
+int lnum_digits(double x, char *digits, int *exp) {
+  int n;
+  if (lgrisu(x, digits, &n, exp)) {
+    *exp += n - 1;
+    return n;
+  }
+
+  // print more digits until they read back as x
+  char buf[32];
+  for (int p = 1; p <= 17; p++) {
+    snprintf(buf, sizeof(buf), "%.*e", p - 1, x);
+    if (strtod(buf, NULL) == x)
+      break;
+  }
+  n = 0;
+  char *c = buf;
+  for (; *c != 'e'; c++)
+    if (*c != '.')
+      digits[n++] = *c;
+  *exp = atoi(c + 1);
+  return n;
+}
+
+// x into s in at most LNUM_MAX bytes, returns the length
+int lnum_format(char *s, double x) {
+  if (! isfinite(x))
+    return snprintf(s, LNUM_MAX, "%f", x);
+
+  int len = 0;
+  if (signbit(x)) {
+    s[len++] = '-';
+    x = -x;
+  }
+
+  // When x times a small power of ten is an integer below 2^53, dividing
+  // it back is exactly how the reader rounds, so the first power that
+  // gives x back has the fewest digits.
+  for (int k = 0; k <= 22 && x * lnum_pow10[k] < 9007199254740992.0; k++) {
+    double m = nearbyint(x * lnum_pow10[k]);
+    if (m / lnum_pow10[k] != x)
+      continue;
+    char d[20];
+    int n = lnum_uint(d, (uint64_t)m);
+    if (n <= k) {
+      s[len++] = '0';
+      s[len++] = '.';
+      memset(s + len, '0', k - n);
+      len += k - n;
+      memcpy(s + len, d, n);
+      len += n;
+    } else {
+      memcpy(s + len, d, n - k);
+      len += n - k;
+      if (k > 0) {
+        s[len++] = '.';
+        memcpy(s + len, d + n - k, k);
+        len += k;
+      }
+    }
+    // a fraction never ends in zeros
+    while (k > 0 && s[len - 1] == '0')
+      len--;
+    if (s[len - 1] == '.')
+      len--;
+    return len;
+  }
+
+  char d[20];
+  int exp;
+  int n = lnum_digits(x, d, &exp);
+  if (exp >= n - 1) {
+    memcpy(s + len, d, n);
+    len += n;
+    memset(s + len, '0', exp - (n - 1));
+    len += exp - (n - 1);
+  } else if (exp >= 0) {
+    memcpy(s + len, d, exp + 1);
+    len += exp + 1;
+    s[len++] = '.';
+    memcpy(s + len, d + exp + 1, n - exp - 1);
+    len += n - exp - 1;
+  } else {
+    s[len++] = '0';
+    s[len++] = '.';
+    memset(s + len, '0', -exp - 1);
+    len += -exp - 1;
+    memcpy(s + len, d, n);
+    len += n;
+  }
+  return len;
+}
+
+void lbuf_num(lbuf *b, double x) {
+  lbuf_reserve(b, LNUM_MAX);
+  b->len += lnum_format(b->data + b->len, x);
+  b->data[b->len] = '\0';
+  if (b->out && b->len >= LBUF_FLUSH)
+    lbuf_flush(b);
+}
+
+// start is where the value being printed began in b, the byte limit is
+// counted from there
+void lval_mat_print(lbuf *b, lval *v, const lprint_limits *l, size_t start) {
+  int rows = l->elements && v->rows > l->elements ? l->elements : v->rows;
+  int cols = l->elements && v->cols > l->elements ? l->elements : v->cols;
+  int full = 0;
+
+  lbuf_putc(b, '[');
+  for (int i = 0; i < rows && ! full; i++) {
+    lbuf_putc(b, '[');
+    for (int j = 0; j < cols; j++) {
+      if (l->bytes && b->flushed + b->len - start >= l->bytes) {
+        // close what is open after this
+        lbuf_puts(b, "...");
+        full = 1;
+        break;
+      }
+      lbuf_num(b, v->mat[i * v->cols + j]);
+      if (j != v->cols - 1)
+        lbuf_putc(b, ' ');
+    }
+    if (! full && cols < v->cols)
+      lbuf_puts(b, "...");
+    lbuf_putc(b, ']');
+    if (! full && i != v->rows - 1)
+      lbuf_putc(b, ' ');
+  }
+  if (! full && rows < v->rows)
+    lbuf_puts(b, "...");
+  lbuf_putc(b, ']');
+}
+
+void lval_atom_print(lbuf *b, lval *v, const lprint_limits *l, size_t start) {
+  switch (v->type) {
+    case LVAL_NUM:
+      lbuf_num(b, v->num); break;
+    case LVAL_ERR:
+      lbuf_printf(b, "Error: %s", v->err); break;
+    case LVAL_SYM:
+      lbuf_puts(b, v->sym); break;
+    case LVAL_FUN:
+      lbuf_puts(b, "<function>"); break;
+    case LVAL_MAT:
+      lval_mat_print(b, v, l, start); break;
+  }
+}
+
+// a list being printed and the index of its next element
+typedef struct {
+  lval *list;
+  int next;
+} lprint_frame;
+
+// The printer walks lists with a stack of its own rather than recursing,
+// so deep values can't overflow the C stack, and output goes out in
+// chunks as the lbuf fills up.
+void lval_print_limited(lbuf *b, lval *v, const lprint_limits *l) {
+  static const lprint_limits unlimited = {0, 0, 0};
+  if (! l)
+    l = &unlimited;
+
+  size_t start = b->flushed + b->len;
+  lprint_frame small[32];
+  lprint_frame *stack = small;
+  int cap = 32, depth = 0, full = 0;
+
+  while (1) {
+    if (v) {
+      if (l->bytes && b->flushed + b->len - start >= l->bytes) {
+        // close what is open after this
+        lbuf_puts(b, "...");
+        full = 1;
+      } else if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        lbuf_putc(b, v->type == LVAL_SEXPR ? '(' : '{');
+        if (l->depth && depth >= l->depth) {
+          if (v->count)
+            lbuf_puts(b, "...");
+          lbuf_putc(b, v->type == LVAL_SEXPR ? ')' : '}');
+        } else {
+          if (depth == cap) {
+            cap *= 2;
+            stack = stack == small
+              ? memcpy(malloc(sizeof(lprint_frame) * cap), small, sizeof(small))
+              : realloc(stack, sizeof(lprint_frame) * cap);
+          }
+          stack[depth].list = v;
+          stack[depth].next = 0;
+          depth++;
+        }
+      } else {
+        lval_atom_print(b, v, l, start);
+      }
+      v = NULL;
+    }
+
+    if (depth == 0)
+      break;
+
+    lprint_frame *f = &stack[depth - 1];
+    if (full || f->next == f->list->count) {
+      lbuf_putc(b, f->list->type == LVAL_SEXPR ? ')' : '}');
+      depth--;
+      continue;
+    }
+
+    // no whitespace before the first element in the list
+    if (f->next > 0)
+      lbuf_putc(b, ' ');
+    if (l->elements && f->next >= l->elements) {
+      lbuf_puts(b, "...");
+      f->next = f->list->count;
+      continue;
+    }
+    v = f->list->cell[f->next++];
+  }
+
+  if (stack != small)
+    free(stack);
+}
+
+void lval_print(lbuf *b, lval *v) { lval_print_limited(b, v, NULL); }
+
+void lval_println(lbuf *b, lval *v) { lval_print(b, v); lbuf_putc(b, '\n'); }
+
+#define LASSERT(args, cond, err) if (!(cond)) { lval_del(args); return lval_err(err); }
+lval *builtin_head(lenv *e, lval *args) {
+  LASSERT(args, args->count == 1, "HEAD was passed incorrect number of arguments.");
+
+  lval* list = args->cell[0];
+  LASSERT(args, list->type == LVAL_QEXPR, "HEAD was passed incorrect type.");
+
+  LASSERT(args, list->count != 0, "HEAD was passed empty list ({}).");
+
+  // take frees the original args list
+  list = lval_take(args, 0);
+
+  // remove the rest
+  while (list->count > 1)
+    lval_del(lval_pop(list, 1));
+
+  return list;
+}
+
+lval *builtin_tail(lenv *e, lval *args) {
+  LASSERT(args, args->count == 1, "TAIL was passed incorrect number of arguments.");
+
+  lval* list = args->cell[0];
+  LASSERT(args, list->type == LVAL_QEXPR, "TAIL was passed incorrect type.");
+  LASSERT(args, list->count != 0, "TAIL was passed an empty list ({}).");
+
+  // take frees the original args list
+  list = lval_take(args, 0);
+
+  // remove the head
+  lval_del(lval_pop(list, 0));
+
+  return list;
+}
+
+lval *builtin_list(lenv *e, lval *args) {
+  args->type = LVAL_QEXPR;
+  return args;
+}
+
+lval *lval_eval(lenv *e, lval *v);
+lval *builtin_eval(lenv *e, lval *args) {
+  LASSERT(args, args->count == 1, "EVAL was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[0]->type == LVAL_QEXPR, "EVAL was passed incorrect type.");
+
+  lval *list = lval_take(args, 0);
+  list->type = LVAL_SEXPR;
+  return lval_eval(e, list);
+}
+
+lval *builtin_join(lenv *e, lval *args) {
+  LASSERT(args, args->count != 0, "JOIN was passed 0 arguments.");
+  for (int i = 0; i < args->count; i++)
+    LASSERT(args, args->cell[i]->type == LVAL_QEXPR, "JOIN was passed incorrect type.");
+
+  lval *res = lval_pop(args, 0);
+  while (args->count > 0)
+    res = lval_join(res, lval_pop(args, 0));
+
+  lval_del(args);
+  return res;
+}
+
+lval *builtin_cons(lenv *e, lval *args) {
+  LASSERT(args, args->count == 2, "CONS was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[1]->type == LVAL_QEXPR, "CONS was passed incorrect type.");
+
+  lval *val = lval_pop(args, 0);
+  lval *list = lval_pop(args, 0);
+  lval *res = lval_qexpr();
+  lval_del(args);
+
+  return lval_join(lval_add(res, val), list);
+}
+
+lval *builtin_len(lenv *e, lval *args) {
+  LASSERT(args, args->count == 1, "LEN was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[0]->type == LVAL_QEXPR, "LEn was passed incorrect type.");
+
+  lval *res = lval_num(args->cell[0]->count);
+  lval_del(args);
+
+  return res;
+}
+
+// arithmetic operators, applied to numbers or elementwise to lists of numbers
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_MOD, LOP_POW, LOP_MIN, LOP_MAX, LOP_NONE };
+
+int lop_find(char *op) {
+  if (! strcmp(op, "+") || ! strcmp(op, "add")) return LOP_ADD;
+  if (! strcmp(op, "-") || ! strcmp(op, "sub")) return LOP_SUB;
+  if (! strcmp(op, "*") || ! strcmp(op, "mul")) return LOP_MUL;
+  if (! strcmp(op, "/") || ! strcmp(op, "div")) return LOP_DIV;
+  if (! strcmp(op, "%") || ! strcmp(op, "mod")) return LOP_MOD;
+  if (! strcmp(op, "^") || ! strcmp(op, "pow")) return LOP_POW;
+  if (! strcmp(op, "min")) return LOP_MIN;
+  if (! strcmp(op, "max")) return LOP_MAX;
+  return LOP_NONE;
+}
+
+// apply a binary operator to x and y, returns an error message on failure
+char *lop_apply(int op, double x, double y, double *res) {
+  switch (op) {
+    case LOP_ADD: *res = x + y; return NULL;
+    case LOP_SUB: *res = x - y; return NULL;
+    case LOP_MUL: *res = x * y; return NULL;
+    case LOP_DIV:
+      // restrict the division by zero, even for doubles for now
+      if (y == 0.0)
+        return "Division by zero when trying to to divide.";
+      *res = x / y;
+      return NULL;
+    case LOP_MOD:
+      if (y == 0.0)
+        return "Division by zero when trying to take mod.";
+      *res = (double)((long)x % (long)y);
+      return NULL;
+    case LOP_POW: *res = pow(x, y); return NULL;
+    case LOP_MIN: *res = fmin(x, y); return NULL;
+    case LOP_MAX: *res = fmax(x, y); return NULL;
+  }
+
+  return "Bad operator.";
+}
+
+lval *evaluate_op(char* op, lval *x, lval *y) {
+  // if either of operands is an error, return it
+  if (x->type == LVAL_ERR) return x;
+  if (y->type == LVAL_ERR) return y;
+
+  double res;
+  char *err = lop_apply(lop_find(op), x->num, y->num, &res);
+  return err ? lval_err(err) : lval_num(res);
+}
+
+// true if v is a q-expression holding only numbers
+int lval_is_numeric(lval *v) {
+  if (v->type != LVAL_QEXPR)
+    return 0;
+  for (int i = 0; i < v->count; i++)
+    if (v->cell[i]->type != LVAL_NUM)
+      return 0;
+  return 1;
+}
+
+// i-th element of an elementwise operand, numbers are broadcast
+double lval_elem(lval *v, int i) {
+  return v->type == LVAL_NUM ? v->num : v->cell[i]->num;
+}
+
+lval *builtin_op_elementwise(lval *args, char *op, int count) {
+  int code = lop_find(op);
+
+  lval *res = lval_qexpr();
+  res->cell = malloc(sizeof(lval*) * count);
+
+  for (int i = 0; i < count; i++) {
+    double x = lval_elem(args->cell[0], i);
+
+    // unary minus negates every element
+    if (args->count == 1 && code == LOP_SUB)
+      x = -x;
+
+    for (int j = 1; j < args->count; j++) {
+      char *err = lop_apply(code, x, lval_elem(args->cell[j], i), &x);
+      if (err) {
+        lval_del(res);
+        lval_del(args);
+        return lval_err(err);
+      }
+    }
+
+    res->cell[res->count++] = lval_num(x);
+  }
+
+  lval_del(args);
+  return res;
+}
+
+lval *builtin_op_matrix(lval *args, char *op) {
+  int code = lop_find(op);
+
+  // the first matrix gives the shape, numbers are broadcast
+  lval *shape = NULL;
+  for (int i = 0; i < args->count; i++)
+    if (args->cell[i]->type == LVAL_MAT) { shape = args->cell[i]; break; }
+
+  lval *res = lval_mat(shape->rows, shape->cols);
+  int n = shape->rows * shape->cols;
+  lval *first = args->cell[0];
+
+  for (int e = 0; e < n; e++) {
+    double x = first->type == LVAL_MAT ? first->mat[e] : first->num;
+    if (args->count == 1 && code == LOP_SUB)
+      x = -x;
+
+    for (int j = 1; j < args->count; j++) {
+      lval *a = args->cell[j];
+      char *err = lop_apply(code, x, a->type == LVAL_MAT ? a->mat[e] : a->num, &x);
+      if (err) {
+        lval_del(res);
+        lval_del(args);
+        return lval_err(err);
+      }
+    }
+    res->mat[e] = x;
+  }
+
+  lval_del(args);
+  return res;
+}
+
+// Dense matrix multiplication c += a * b for rows [from, to) of c, where a
+// is n x p and b is p x m. The loops walk cache sized blocks: a block of b
+// is packed into panels of LMAT_NR columns stored in the order they are
+// read, and a micro-kernel keeps an LMAT_MR x LMAT_NR tile of c in SIMD
+// registers while it runs down one panel.
+#define LMAT_BLOCK 64
+#define LMAT_KC 256
+#define LMAT_NC 256
+#define LMAT_MR 4
+
+#ifdef __AVX__
+#define LMAT_NR 8
+#else
+#define LMAT_NR 4
+#endif
+
+// c[0..LMAT_MR)[0..LMAT_NR) += a * bp, with rows of a at a[0..LMAT_MR) and
+// rows of c ldc apart
+void lmat_kernel(int kc, const double **a, const double *bp, double *c, int ldc) {
+#if defined(__AVX__)
+  __m256d acc[LMAT_MR][2];
+  for (int r = 0; r < LMAT_MR; r++)
+    acc[r][0] = acc[r][1] = _mm256_setzero_pd();
+
+  for (int k = 0; k < kc; k++, bp += LMAT_NR) {
+    __m256d b0 = _mm256_loadu_pd(bp);
+    __m256d b1 = _mm256_loadu_pd(bp + 4);
+    for (int r = 0; r < LMAT_MR; r++) {
+      __m256d x = _mm256_broadcast_sd(&a[r][k]);
+#ifdef __FMA__
+      acc[r][0] = _mm256_fmadd_pd(x, b0, acc[r][0]);
+      acc[r][1] = _mm256_fmadd_pd(x, b1, acc[r][1]);
+#else
+      acc[r][0] = _mm256_add_pd(acc[r][0], _mm256_mul_pd(x, b0));
+      acc[r][1] = _mm256_add_pd(acc[r][1], _mm256_mul_pd(x, b1));
+#endif
+    }
+  }
+
+  for (int r = 0; r < LMAT_MR; r++) {
+    double *row = &c[(size_t)r * ldc];
+    _mm256_storeu_pd(row, _mm256_add_pd(_mm256_loadu_pd(row), acc[r][0]));
+    _mm256_storeu_pd(row + 4, _mm256_add_pd(_mm256_loadu_pd(row + 4), acc[r][1]));
+  }
+#elif defined(__SSE2__)
+  __m128d acc[LMAT_MR][2];
+  for (int r = 0; r < LMAT_MR; r++)
+    acc[r][0] = acc[r][1] = _mm_setzero_pd();
+
+  for (int k = 0; k < kc; k++, bp += LMAT_NR) {
+    __m128d b0 = _mm_loadu_pd(bp);
+    __m128d b1 = _mm_loadu_pd(bp + 2);
+    for (int r = 0; r < LMAT_MR; r++) {
+      __m128d x = _mm_set1_pd(a[r][k]);
+      acc[r][0] = _mm_add_pd(acc[r][0], _mm_mul_pd(x, b0));
+      acc[r][1] = _mm_add_pd(acc[r][1], _mm_mul_pd(x, b1));
+    }
+  }
+
+  for (int r = 0; r < LMAT_MR; r++) {
+    double *row = &c[(size_t)r * ldc];
+    _mm_storeu_pd(row, _mm_add_pd(_mm_loadu_pd(row), acc[r][0]));
+    _mm_storeu_pd(row + 2, _mm_add_pd(_mm_loadu_pd(row + 2), acc[r][1]));
+  }
+#else
+  double acc[LMAT_MR][LMAT_NR] = { { 0 } };
+  for (int k = 0; k < kc; k++, bp += LMAT_NR)
+    for (int r = 0; r < LMAT_MR; r++)
+      for (int j = 0; j < LMAT_NR; j++)
+        acc[r][j] += a[r][k] * bp[j];
+
+  for (int r = 0; r < LMAT_MR; r++)
+    for (int j = 0; j < LMAT_NR; j++)
+      c[(size_t)r * ldc + j] += acc[r][j];
+#endif
+}
+
+// rows [kk, kk + kc) and columns [jj, jj + nc) of b as panels of LMAT_NR
+// columns, each row of a panel after the other; columns past nc are 0
+void lmat_pack(const double *b, int m, int kk, int kc, int jj, int nc, double *bp) {
+  for (int j0 = 0; j0 < nc; j0 += LMAT_NR)
+    for (int k = 0; k < kc; k++) {
+      const double *brow = &b[(size_t)(kk + k) * m + jj];
+      for (int j = j0; j < j0 + LMAT_NR; j++)
+        *bp++ = j < nc ? brow[j] : 0;
+    }
+}
+
+void lmat_mul(double *a, double *b, double *c, int p, int m, int from, int to) {
+  double *bp = malloc(sizeof(double) * LMAT_KC * (LMAT_NC + LMAT_NR));
+  double *zero = calloc(LMAT_KC, sizeof(double));
+
+  for (int jj = 0; jj < m; jj += LMAT_NC) {
+    int nc = m - jj < LMAT_NC ? m - jj : LMAT_NC;
+    for (int kk = 0; kk < p; kk += LMAT_KC) {
+      int kc = p - kk < LMAT_KC ? p - kk : LMAT_KC;
+      lmat_pack(b, m, kk, kc, jj, nc, bp);
+
+      for (int i = from; i < to; i += LMAT_MR) {
+        int mr = to - i < LMAT_MR ? to - i : LMAT_MR;
+
+        // rows past the end read zeros and their results are dropped
+        const double *arows[LMAT_MR];
+        for (int r = 0; r < LMAT_MR; r++)
+          arows[r] = r < mr ? &a[(size_t)(i + r) * p + kk] : zero;
+
+        for (int j0 = 0; j0 < nc; j0 += LMAT_NR) {
+          int nr = nc - j0 < LMAT_NR ? nc - j0 : LMAT_NR;
+          const double *panel = &bp[(size_t)j0 * kc];
+          double *ctile = &c[(size_t)i * m + jj + j0];
+
+          if (mr == LMAT_MR && nr == LMAT_NR) {
+            lmat_kernel(kc, arows, panel, ctile, m);
+            continue;
+          }
+
+          // partial tiles go through a full sized one
+          double tile[LMAT_MR * LMAT_NR] = { 0 };
+          lmat_kernel(kc, arows, panel, tile, LMAT_NR);
+          for (int r = 0; r < mr; r++)
+            for (int j = 0; j < nr; j++)
+              ctile[(size_t)r * m + j] += tile[r * LMAT_NR + j];
+        }
+      }
+    }
+  }
+
+  free(zero);
+  free(bp);
+}
+
+lval *builtin_op(lval *args, char *op) {
+  // all arguments should be numbers or equally long lists of numbers,
+  // or equally shaped matrices
+  int count = -1;
+  lval *shape = NULL;
+  for (int i = 0; i < args->count; i++) {
+    lval *a = args->cell[i];
+    if (a->type == LVAL_NUM)
+      continue;
+
+    if (a->type == LVAL_MAT) {
+      if (shape && (a->rows != shape->rows || a->cols != shape->cols)) {
+        lval_del(args);
+        return lval_err("Cannot operate on matrices of different shapes.");
+      }
+      shape = a;
+      continue;
+    }
+
+    if (! lval_is_numeric(a)) {
+      lval_del(args);
+      return lval_err("Cannot operate on non-numbers.");
+    }
+    if (count != -1 && a->count != count) {
+      lval_del(args);
+      return lval_err("Cannot operate on lists of different lengths.");
+    }
+    count = a->count;
+  }
+
+  if (shape && count != -1) {
+    lval_del(args);
+    return lval_err("Cannot operate on matrices and lists together.");
+  }
+
+  // any list or matrix makes the operation elementwise
+  if (shape)
+    return builtin_op_matrix(args, op);
+  if (count != -1)
+    return builtin_op_elementwise(args, op, count);
+
+  // use the first argument as the base
+  lval *res = lval_pop(args, 0);
+
+  // Special case for unary minus:
+  if (args->count == 0 && strcmp("-", op) == 0)
+    res->num = -res->num;
+
+  while (args->count > 0) {
+    lval *x = lval_pop(args, 0);
+    lval *newRes = evaluate_op(op, res, x);
+    lval_del(res);
+    lval_del(x);
+
+    res = newRes;
+    if (res->type == LVAL_ERR)
+      break;
+  }
+
+  lval_del(args);
+  return res;
+}
+
+lval *builtin_matrix(lenv *e, lval *args) {
+  LASSERT(args, args->count == 1, "MATRIX was passed incorrect number of arguments.");
+
+  lval *rows = args->cell[0];
+  LASSERT(args, rows->type == LVAL_QEXPR, "MATRIX was passed incorrect type.");
+  LASSERT(args, rows->count != 0, "MATRIX was passed an empty list ({}).");
+
+  int cols = rows->cell[0]->type == LVAL_QEXPR ? rows->cell[0]->count : 0;
+  for (int i = 0; i < rows->count; i++) {
+    LASSERT(args, lval_is_numeric(rows->cell[i]), "MATRIX rows should be lists of numbers.");
+    LASSERT(args, rows->cell[i]->count == cols && cols != 0, "MATRIX rows should have the same non-zero length.");
+  }
+
+  lval *res = lval_mat(rows->count, cols);
+  for (int i = 0; i < rows->count; i++)
+    for (int j = 0; j < cols; j++)
+      res->mat[i * cols + j] = rows->cell[i]->cell[j]->num;
+
+  lval_del(args);
+  return res;
+}
+
+lval *builtin_transpose(lenv *e, lval *args) {
+  LASSERT(args, args->count == 1, "TRANSPOSE was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[0]->type == LVAL_MAT, "TRANSPOSE was passed incorrect type.");
+
+  lval *m = args->cell[0];
+  lval *res = lval_mat(m->cols, m->rows);
+
+  // walk in square tiles so neither side is strided across the whole matrix
+  for (int ii = 0; ii < m->rows; ii += LMAT_BLOCK)
+    for (int jj = 0; jj < m->cols; jj += LMAT_BLOCK)
+      for (int i = ii; i < m->rows && i < ii + LMAT_BLOCK; i++)
+        for (int j = jj; j < m->cols && j < jj + LMAT_BLOCK; j++)
+          res->mat[j * m->rows + i] = m->mat[i * m->cols + j];
+
+  lval_del(args);
+  return res;
+}
+
+// products with at least this many multiply-adds are split across the pool
+#define LMAT_PARALLEL (1 << 20)
+
+typedef struct {
+  double *a, *b, *c;
+  int p, m, from, to;
+} lmat_job;
+
+void lmat_mul_job(void *arg) {
+  lmat_job *j = arg;
+  lmat_mul(j->a, j->b, j->c, j->p, j->m, j->from, j->to);
+}
+
+// multiply in bands of rows, each band a task of its own
+void lmat_mul_parallel(double *a, double *b, double *c, int n, int p, int m) {
+  int workers = task_pool_size();
+  if (workers < 2 || (double)n * p * m < LMAT_PARALLEL) {
+    lmat_mul(a, b, c, p, m, 0, n);
+    return;
+  }
+
+  // a few bands per worker so stealing can even out the load,
+  // but never thinner than a block
+  int band = n / (workers * 4);
+  if (band < LMAT_BLOCK)
+    band = LMAT_BLOCK;
+
+  int jobs_num = (n + band - 1) / band;
+  lmat_job *jobs = malloc(sizeof(lmat_job) * jobs_num);
+  task **tasks = malloc(sizeof(task*) * jobs_num);
+
+  for (int i = 0; i < jobs_num; i++) {
+    lmat_job j = { a, b, c, p, m, i * band, (i + 1) * band < n ? (i + 1) * band : n };
+    jobs[i] = j;
+    tasks[i] = task_spawn(lmat_mul_job, &jobs[i]);
+  }
+  for (int i = 0; i < jobs_num; i++)
+    task_join(tasks[i]);
+
+  free(tasks);
+  free(jobs);
+}
+
+lval *builtin_matmul(lenv *e, lval *args) {
+  LASSERT(args, args->count == 2, "MATMUL was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[0]->type == LVAL_MAT && args->cell[1]->type == LVAL_MAT,
+      "MATMUL was passed incorrect type.");
+
+  lval *a = args->cell[0];
+  lval *b = args->cell[1];
+  LASSERT(args, a->cols == b->rows, "MATMUL was passed matrices of incompatible shapes.");
+
+  lval *res = lval_mat(a->rows, b->cols);
+  lmat_mul_parallel(a->mat, b->mat, res->mat, a->rows, a->cols, b->cols);
+
+  lval_del(args);
+  return res;
+}
+
+lval *builtin_matvec(lenv *e, lval *args) {
+  LASSERT(args, args->count == 2, "MATVEC was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[0]->type == LVAL_MAT, "MATVEC was passed incorrect type.");
+  LASSERT(args, lval_is_numeric(args->cell[1]), "MATVEC was passed incorrect type.");
+
+  lval *m = args->cell[0];
+  lval *v = args->cell[1];
+  LASSERT(args, m->cols == v->count, "MATVEC was passed a list of incompatible length.");
+
+  // pack the vector once so the dot products run over plain arrays
+  double *x = malloc(sizeof(double) * (v->count + 1));
+  for (int j = 0; j < v->count; j++)
+    x[j] = v->cell[j]->num;
+
+  lval *res = lval_qexpr();
+  res->cell = malloc(sizeof(lval*) * m->rows);
+  for (int i = 0; i < m->rows; i++) {
+    double *row = &m->mat[i * m->cols];
+    double sum = 0.0;
+    for (int j = 0; j < m->cols; j++)
+      sum += row[j] * x[j];
+    res->cell[res->count++] = lval_num(sum);
+  }
+
+  free(x);
+  lval_del(args);
+  return res;
+}
+
+// pmap and preduce evaluate their function body over chunks of the list on
+// the task pool. Chunks are put back together in list order, so the result
+// doesn't depend on which worker finished first. preduce combines the items
+// of each chunk and then the chunk results, so its body should be associative.
+typedef struct {
+  lenv *env;
+  lval *body;    // function body, only read by the tasks
+  lval **items;  // pmap stores the results back in place
+  int count;
+  lval *res;     // preduce result of the chunk
+} lpar_chunk;
+
+// evaluate the function body with x (and y) appended as arguments
+lval *lval_call(lenv *e, lval *body, lval *x, lval *y) {
+  lval *expr = lval_add(lval_copy(body), x);
+  if (y)
+    expr = lval_add(expr, y);
+  return builtin_eval(e, lval_add(lval_sexpr(), expr));
+}
+
+void lpar_map(void *arg) {
+  lpar_chunk *c = arg;
+  for (int i = 0; i < c->count; i++)
+    c->items[i] = lval_call(c->env, c->body, c->items[i], NULL);
+}
+
+void lpar_reduce(void *arg) {
+  lpar_chunk *c = arg;
+  lval *acc = c->items[0];
+  for (int i = 1; i < c->count; i++) {
+    if (acc->type == LVAL_ERR) {
+      lval_del(c->items[i]);
+      continue;
+    }
+    acc = lval_call(c->env, c->body, acc, c->items[i]);
+  }
+  c->res = acc;
+}
+
+// preduce groups its items by this many whatever the number of workers, so
+// that floating point sums come out the same on every machine
+#define LPAR_REDUCE_CHUNK 1024
+
+// split the items of list into chunks of size and run f over them in
+// parallel
+lpar_chunk *lpar_run(lenv *e, lval *body, lval *list, task_fn f, int size, int *chunks_num) {
+  int n = (list->count + size - 1) / size;
+
+  lpar_chunk *chunks = malloc(sizeof(lpar_chunk) * n);
+  task **tasks = malloc(sizeof(task*) * n);
+
+  for (int i = 0; i < n; i++) {
+    chunks[i].env = e;
+    chunks[i].body = body;
+    chunks[i].items = &list->cell[i * size];
+    chunks[i].count = (i + 1) * size < list->count ? size : list->count - i * size;
+    chunks[i].res = NULL;
+    tasks[i] = task_spawn(f, &chunks[i]);
+  }
+  for (int i = 0; i < n; i++)
+    task_join(tasks[i]);
+
+  free(tasks);
+  *chunks_num = n;
+  return chunks;
+}
+
+lval *builtin_pmap(lenv *e, lval *args) {
+  LASSERT(args, args->count == 2, "PMAP was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[0]->type == LVAL_QEXPR, "PMAP was passed incorrect type.");
+  LASSERT(args, args->cell[1]->type == LVAL_QEXPR, "PMAP was passed incorrect type.");
+
+  lval *list = lval_pop(args, 1);
+  // a few chunks per worker so stealing can even out the load; the
+  // grouping doesn't show in the result
+  int size = list->count / (task_pool_size() * 4 + 1) + 1;
+  int chunks_num;
+  free(lpar_run(e, args->cell[0], list, lpar_map, size, &chunks_num));
+  lval_del(args);
+
+  // report the error of the first failing element
+  for (int i = 0; i < list->count; i++)
+    if (list->cell[i]->type == LVAL_ERR)
+      return lval_take(list, i);
+
+  return list;
+}
+
+lval *builtin_preduce(lenv *e, lval *args) {
+  LASSERT(args, args->count == 2, "PREDUCE was passed incorrect number of arguments.");
+  LASSERT(args, args->cell[0]->type == LVAL_QEXPR, "PREDUCE was passed incorrect type.");
+  LASSERT(args, args->cell[1]->type == LVAL_QEXPR, "PREDUCE was passed incorrect type.");
+  LASSERT(args, args->cell[1]->count != 0, "PREDUCE was passed an empty list ({}).");
+
+  // the chunks take over the items, only the list itself is left to free
+  lval *list = lval_pop(args, 1);
+  int chunks_num;
+  lpar_chunk *chunks = lpar_run(e, args->cell[0], list, lpar_reduce, LPAR_REDUCE_CHUNK, &chunks_num);
+  list->count = 0;
+  lval_del(list);
+
+  // combine the chunk results left to right
+  lval *acc = chunks[0].res;
+  for (int i = 1; i < chunks_num; i++) {
+    if (acc->type == LVAL_ERR) {
+      lval_del(chunks[i].res);
+      continue;
+    }
+    acc = lval_call(e, args->cell[0], acc, chunks[i].res);
+  }
+
+  free(chunks);
+  lval_del(args);
+  return acc;
+}
+
+// every builtin function by name, images refer to them by these names
+struct {
+  char *name;
+  lbuiltin func;
+} lbuiltins[] = {
+  { "list", builtin_list },
+  { "head", builtin_head },
+  { "tail", builtin_tail },
+  { "eval", builtin_eval },
+  { "join", builtin_join },
+  { "cons", builtin_cons },
+  { "len", builtin_len },
+  { "matrix", builtin_matrix },
+  { "transpose", builtin_transpose },
+  { "matmul", builtin_matmul },
+  { "matvec", builtin_matvec },
+  { "pmap", builtin_pmap },
+  { "preduce", builtin_preduce },
+  { NULL, NULL }
+};
+
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
+  e->count++;
+  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  e->funs = realloc(e->funs, sizeof(lbuiltin) * e->count);
+  e->syms[e->count - 1] = name;
+  e->funs[e->count - 1] = func;
+}
+
+// fill in the builtins, settings and statistics of a fresh context
+void lenv_init(lenv *e) {
+  e->count = 0;
+  e->syms = NULL;
+  e->funs = NULL;
+  e->parallel_threshold = 0;
+  e->print_limits = (lprint_limits){0, 0, 0};
+  atomic_init(&e->exprs, 0);
+  atomic_init(&e->errors, 0);
+
+  for (int i = 0; lbuiltins[i].name; i++)
+    lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+}
+
+void lenv_clear(lenv *e) {
+  free(e->syms);
+  free(e->funs);
+}
+
+lbuiltin lenv_get(lenv *e, char *name) {
+  for (int i = 0; i < e->count; i++)
+    if (! strcmp(e->syms[i], name))
+      return e->funs[i];
+  return NULL;
+}
+
+lval *builtin(lenv *e, lval *args, char *func) {
+  lbuiltin f = lenv_get(e, func);
+  if (f)
+    return f(e, args);
+  // anything else is an arithmetic operator
+  return builtin_op(args, func);
+}
+
+// Nested elementwise arithmetic like (+ (* a b) c) is compiled into a
+// small postfix program and run as one loop over the elements, instead of
+// building a temporary list for every inner operator.
+typedef struct {
+  int op;      // operator, or LOP_NONE for an operand
+  int argc;    // number of operands taken by the operator
+  double num;  // number operand
+  lval *list;  // list operand, NULL for numbers
+} lfused_ins;
+
+typedef struct {
+  int count;
+  int cap;
+  lfused_ins *ins;
+  int length;  // length shared by all the list operands, -1 if none
+  int depth;   // current and maximum stack depth of the program
+  int max_depth;
+  int nested;  // number of operators in the program
+} lfused;
+
+void lfused_push(lfused *f, lfused_ins in) {
+  if (f->count == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 16;
+    f->ins = realloc(f->ins, sizeof(lfused_ins) * f->cap);
+  }
+  f->ins[f->count++] = in;
+}
+
+// compile v into f, returns 0 if v can't be fused
+int lfused_compile(lfused *f, lval *v) {
+  lfused_ins in = { LOP_NONE, 0, 0.0, NULL };
+
+  if (v->type == LVAL_NUM) {
+    in.num = v->num;
+  } else if (v->type == LVAL_QEXPR) {
+    if (! lval_is_numeric(v) || (f->length != -1 && f->length != v->count))
+      return 0;
+    f->length = v->count;
+    in.list = v;
+  } else if (v->type == LVAL_SEXPR) {
+    if (v->count < 2 || v->cell[0]->type != LVAL_SYM)
+      return 0;
+    in.op = lop_find(v->cell[0]->sym);
+    if (in.op == LOP_NONE)
+      return 0;
+
+    for (int i = 1; i < v->count; i++)
+      if (! lfused_compile(f, v->cell[i]))
+        return 0;
+
+    in.argc = v->count - 1;
+    f->depth -= in.argc;
+    f->nested++;
+  } else {
+    return 0;
+  }
+
+  lfused_push(f, in);
+  f->depth++;
+  if (f->depth > f->max_depth)
+    f->max_depth = f->depth;
+  return 1;
+}
+
+// run the program for every element, returns NULL on an arithmetic error
+lval *lfused_run(lfused *f) {
+  double *stack = malloc(sizeof(double) * f->max_depth);
+  lval *res = lval_qexpr();
+  res->cell = malloc(sizeof(lval*) * f->length);
+
+  for (int i = 0; i < f->length; i++) {
+    int top = 0;
+    for (int k = 0; k < f->count; k++) {
+      lfused_ins *in = &f->ins[k];
+      if (in->op == LOP_NONE) {
+        stack[top++] = in->list ? in->list->cell[i]->num : in->num;
+        continue;
+      }
+
+      top -= in->argc;
+      double x = stack[top];
+      if (in->argc == 1 && in->op == LOP_SUB)
+        x = -x;
+      for (int j = 1; j < in->argc; j++) {
+        if (lop_apply(in->op, x, stack[top + j], &x)) {
+          free(stack);
+          lval_del(res);
+          return NULL;
+        }
+      }
+      stack[top++] = x;
+    }
+
+    res->cell[res->count++] = lval_num(stack[0]);
+  }
+
+  free(stack);
+  return res;
+}
+
+int lfused_operator(lval *v) {
+  return v->type == LVAL_SEXPR && v->count >= 2 && v->cell[0]->type == LVAL_SYM &&
+    lop_find(v->cell[0]->sym) != LOP_NONE;
+}
+
+// whether sexpr is an operator with an operator among its operands, which
+// fusing needs, checked before compiling anything
+int lfused_candidate(lval *sexpr) {
+  if (! lfused_operator(sexpr))
+    return 0;
+  for (int i = 1; i < sexpr->count; i++)
+    if (lfused_operator(sexpr->cell[i]))
+      return 1;
+  return 0;
+}
+
+// evaluate sexpr as a fused elementwise expression, returns NULL if it
+// isn't one and leaves sexpr untouched in that case
+lval *lval_eval_fused(lval *sexpr) {
+  lfused f = { 0, 0, NULL, -1, 0, 0, 0 };
+  lval *res = NULL;
+
+  // only worth it with at least one list; on errors the regular
+  // evaluation runs to report them as usual, which also covers empty
+  // lists, where the loop would never meet an error of the numbers
+  if (lfused_compile(&f, sexpr) && f.nested > 1 && f.length > 0)
+    res = lfused_run(&f);
+
+  free(f.ins);
+  if (res)
+    lval_del(sexpr);
+  return res;
+}
+
+// Opt-in parallel evaluation of arguments: s-expression arguments with at
+// least parallel_threshold nodes are evaluated as tasks of their own.
+// Builtins have no side effects and errors are still picked by position
+// after all the arguments are done, so results match the serial order.
+
+// number of nodes in v, counting stops at limit
+int lval_cost(lval *v, int limit) {
+  int n = 1;
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+    for (int i = 0; i < v->count && n < limit; i++)
+      n += lval_cost(v->cell[i], limit - n);
+  return n;
+}
+
+typedef struct {
+  lenv *env;
+  lval **slot;
+  int fuse;
+  task *t;
+} lval_eval_job;
+
+void lval_eval_run(void *arg) {
+  lval_eval_job *j = arg;
+  *j->slot = lval_eval_in(j->env, *j->slot, j->fuse);
+}
+
+void lval_eval_children(lenv *e, lval *sexpr, int fuse) {
+  lval_eval_job *jobs = NULL;
+  int threshold = e->parallel_threshold;
+
+  if (threshold > 0 && task_pool_size() > 0 && sexpr->count > 1) {
+    jobs = calloc(sexpr->count, sizeof(lval_eval_job));
+    for (int i = 0; i < sexpr->count; i++) {
+      if (sexpr->cell[i]->type == LVAL_SEXPR &&
+          lval_cost(sexpr->cell[i], threshold) >= threshold) {
+        jobs[i].env = e;
+        jobs[i].slot = &sexpr->cell[i];
+        jobs[i].fuse = fuse;
+        jobs[i].t = task_spawn(lval_eval_run, &jobs[i]);
+      }
+    }
+  }
+
+  // the cheap ones are evaluated right here
+  for (int i = 0; i < sexpr->count; i++)
+    if (! jobs || ! jobs[i].t)
+      sexpr->cell[i] = lval_eval_in(e, sexpr->cell[i], fuse);
+
+  if (jobs) {
+    for (int i = 0; i < sexpr->count; i++)
+      if (jobs[i].t)
+        task_join(jobs[i].t);
+    free(jobs);
+  }
+}
+
+lval *lval_eval_sexpr(lenv *e, lval *sexpr, int fuse) {
+  // nested elementwise arithmetic is evaluated in a single pass; it is
+  // tried once at the outermost operator, whose whole subtree that
+  // compiles, so its parts are not tried again
+  if (fuse && lfused_candidate(sexpr)) {
+    lval *fused = lval_eval_fused(sexpr);
+    if (fused)
+      return fused;
+    fuse = 0;
+  }
+
+  // evaluate all the children first
+  lval_eval_children(e, sexpr, fuse);
+
+  // check if any of the children evaluations returned an error
+  for (int i = 0; i < sexpr->count; i++)
+    if (sexpr->cell[i]->type == LVAL_ERR)
+      return lval_take(sexpr, i);
+
+  // an empty expression is resulted into an empty expression:
+  // () -> ()
+  if (sexpr->count == 0)
+    return sexpr;
+
+  // expression with a single children is resulted into this children
+  // (6) -> 6
+  if (sexpr->count == 1)
+    return lval_take(sexpr, 0);
+
+  // (sym arg arg arg ...)
+  // first child should be a symbol
+  lval *op = lval_pop(sexpr, 0);
+
+  if (op->type != LVAL_SYM) {
+    lval_del(op);
+    lval_del(sexpr);
+    return lval_err("S-expression doesn't start with a symbol.");
+  }
+
+  lval *result = builtin(e, sexpr, op->sym);
+  lval_del(op);
+  return result;
+}
+
+lval *lval_eval_in(lenv *e, lval *v, int fuse) {
+  // S-expression should be evaluated
+  if (v->type == LVAL_SEXPR)
+    return lval_eval_sexpr(e, v, fuse);
+  // evaluate to itself
+  return v;
+}
+
+lval *lval_eval(lenv *e, lval *v) { return lval_eval_in(e, v, 1); }
+
+int eval_print(lenv *e, lbuf *out, char *filename, char *input, int row, int col) {
+  return eval_print_n(e, out, filename, input, strlen(input), row, col);
+}
+
+int eval_print_n(lenv *e, lbuf *out, char *filename, const char *input, size_t len, int row, int col) {
+  atomic_fetch_add_explicit(&e->exprs, 1, memory_order_relaxed);
+
+  mpc_result_t r;
+  lval *x = lscan_read(input, len);
+  if (x || mpc_parse_n(filename, input, len, e->grammar->read_program, &r)) {
+    // print the result of evaluation
+    x = lval_eval(e, x ? x : r.output);
+    if (x->type == LVAL_ERR)
+      atomic_fetch_add_explicit(&e->errors, 1, memory_order_relaxed);
+    lval_print_limited(out, x, &e->print_limits);
+    lbuf_putc(out, '\n');
+    lval_del(x);
+    return 1;
+  }
+  mpc_err_delete(r.error);
+
+  atomic_fetch_add_explicit(&e->errors, 1, memory_order_relaxed);
+
+  // print the error of the regular grammar
+  mpc_parse_n(filename, input, len, e->grammar->program, &r);
+  if (r.error->state.row == 0)
+    r.error->state.col += col;
+  r.error->state.row += row;
+
+  char *err = mpc_err_string(r.error);
+  lbuf_puts(out, err);
+  free(err);
+  mpc_err_delete(r.error);
+  return 0;
+}
+
+lenv *lenv_new(lgrammar *g) {
+  // creating a context is cheap since the grammar is shared
+  lenv *e = malloc(sizeof(lenv));
+  e->grammar = g;
+  lenv_init(e);
+  return e;
+}
+
+lenv *minilisp_new(void) {
+  return lenv_new(minilisp_grammar_get(NULL, 0));
+}
+
+char *minilisp_grammar_image(size_t *size) {
+  lgrammar *g = lgrammar_new();
+  char *image = lgrammar_save(g, size);
+  lgrammar_del(g);
+  return image;
+}
+
+void minilisp_delete(lenv *e) {
+  lenv_clear(e);
+  free(e);
+}
+
+void minilisp_reset(lenv *e) {
+  lenv_clear(e);
+  lenv_init(e);
+}
+
+void minilisp_set_parallel(lenv *e, int nodes) {
+  e->parallel_threshold = nodes > 0 ? nodes : 0;
+}
+
+void minilisp_set_print_limits(lenv *e, int depth, long elements, size_t bytes) {
+  e->print_limits.depth = depth > 0 ? depth : 0;
+  e->print_limits.elements = elements > 0 ? elements : 0;
+  e->print_limits.bytes = bytes;
+}
+
+long minilisp_exprs(lenv *e) { return atomic_load(&e->exprs); }
+long minilisp_errors(lenv *e) { return atomic_load(&e->errors); }
+
+lval *minilisp_eval(lenv *e, const char *input, size_t len) {
+  atomic_fetch_add_explicit(&e->exprs, 1, memory_order_relaxed);
+
+  lval *x = lscan_read(input, len);
+  if (x) {
+    x = lval_eval(e, x);
+    if (x->type == LVAL_ERR)
+      atomic_fetch_add_explicit(&e->errors, 1, memory_order_relaxed);
+    return x;
+  }
+
+  mpc_result_t r;
+  if (! mpc_parse_n("<input>", input, len, e->grammar->read_program, &r)) {
+    atomic_fetch_add_explicit(&e->errors, 1, memory_order_relaxed);
+    mpc_err_delete(r.error);
+    mpc_parse_n("<input>", input, len, e->grammar->program, &r);
+
+    // the message without its trailing newline
+    char *msg = mpc_err_string(r.error);
+    size_t n = strlen(msg);
+    if (n > 0 && msg[n - 1] == '\n')
+      msg[n - 1] = '\0';
+    lval *err = lval_err(msg);
+    free(msg);
+    mpc_err_delete(r.error);
+    return err;
+  }
+
+  x = lval_eval(e, r.output);
+  if (x->type == LVAL_ERR)
+    atomic_fetch_add_explicit(&e->errors, 1, memory_order_relaxed);
+  return x;
+}
+
+int minilisp_type(const lval *v) { return v->type; }
+double minilisp_number(const lval *v) { return v->type == LVAL_NUM ? v->num : 0; }
+
+const char *minilisp_string(const lval *v) {
+  if (v->type == LVAL_ERR)
+    return v->err;
+  return v->type == LVAL_SYM ? v->sym : NULL;
+}
+
+int minilisp_length(const lval *v) {
+  return v->type == LVAL_SEXPR || v->type == LVAL_QEXPR ? v->count : 0;
+}
+
+const lval *minilisp_element(const lval *v, int i) {
+  return i >= 0 && i < minilisp_length(v) ? v->cell[i] : NULL;
+}
+
+int minilisp_rows(const lval *v) { return v->type == LVAL_MAT ? v->rows : 0; }
+int minilisp_cols(const lval *v) { return v->type == LVAL_MAT ? v->cols : 0; }
+const double *minilisp_matrix(const lval *v) { return v->type == LVAL_MAT ? v->mat : NULL; }
+
+void minilisp_free(lval *v) { lval_del(v); }
+
+char *minilisp_format(lval *v) {
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lval_print(&b, v);
+  lbuf_reserve(&b, 0);
+  return b.data;
+}
+
+// An image holds a context and the compiled grammar, so that loading it
+// skips the grammar and regex compilers:
+//
+//   "MLIM", version, parallel threshold, print depth, print elements,
+//   print bytes, number of builtins, builtin names, grammar image size,
+//   grammar image (see mpc_image_save)
+//
+// Numbers are 32 bit in host byte order, except for the element and byte
+// print limits which are 64 bit, and names are a length followed by the
+// bytes. The environment only ever holds builtins, which are stored by
+// name and looked up again on loading.
+#define LIMAGE_MAGIC 0x4d494c4d
+#define LIMAGE_VERSION 2
+
+void limage_u32(lbuf *b, uint32_t x) { lbuf_write(b, (char*)&x, sizeof(x)); }
+void limage_u64(lbuf *b, uint64_t x) { lbuf_write(b, (char*)&x, sizeof(x)); }
+
+int minilisp_save_image(lenv *e, const char *path) {
+  size_t size;
+  char *grammar = lgrammar_save(e->grammar, &size);
+  if (! grammar)
+    return 0;
+
+  lbuf b;
+  lbuf_init(&b, NULL);
+  limage_u32(&b, LIMAGE_MAGIC);
+  limage_u32(&b, LIMAGE_VERSION);
+  limage_u32(&b, e->parallel_threshold);
+  limage_u32(&b, e->print_limits.depth);
+  limage_u64(&b, e->print_limits.elements);
+  limage_u64(&b, e->print_limits.bytes);
+  limage_u32(&b, e->count);
+  for (int i = 0; i < e->count; i++) {
+    limage_u32(&b, strlen(e->syms[i]));
+    lbuf_puts(&b, e->syms[i]);
+  }
+  limage_u32(&b, size);
+  lbuf_write(&b, grammar, size);
+  free(grammar);
+
+  FILE *f = fopen(path, "wb");
+  int ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+  if (f && fclose(f) != 0)
+    ok = 0;
+  lbuf_free(&b);
+  return ok;
+}
+
+typedef struct {
+  const char *data;
+  size_t len;
+  size_t pos;
+} limage;
+
+int limage_u32_read(limage *im, uint32_t *x) {
+  if (im->pos + sizeof(*x) > im->len)
+    return 0;
+  memcpy(x, im->data + im->pos, sizeof(*x));
+  im->pos += sizeof(*x);
+  return 1;
+}
+
+int limage_u64_read(limage *im, uint64_t *x) {
+  if (im->pos + sizeof(*x) > im->len)
+    return 0;
+  memcpy(x, im->data + im->pos, sizeof(*x));
+  im->pos += sizeof(*x);
+  return 1;
+}
+
+// the bytes of the next n long field, NULL past the end
+const char *limage_bytes(limage *im, uint32_t n) {
+  if (im->pos + n > im->len)
+    return NULL;
+  im->pos += n;
+  return im->data + im->pos - n;
+}
+
+lenv *limage_load(limage *im) {
+  uint32_t magic, version, threshold, depth, count, len;
+  uint64_t elements, bytes;
+  if (! limage_u32_read(im, &magic) || magic != LIMAGE_MAGIC ||
+      ! limage_u32_read(im, &version) || version != LIMAGE_VERSION ||
+      ! limage_u32_read(im, &threshold) || ! limage_u32_read(im, &depth) ||
+      ! limage_u64_read(im, &elements) || ! limage_u64_read(im, &bytes) ||
+      ! limage_u32_read(im, &count))
+    return NULL;
+
+  // a context holds each builtin once, anything more is a damaged image
+  // and would overflow the arrays below
+  if (count > sizeof(lbuiltins) / sizeof(lbuiltins[0]) - 1)
+    return NULL;
+
+  // resolve the builtins by name before building anything
+  lbuiltin *funs = malloc(sizeof(lbuiltin) * (count + 1));
+  char **syms = malloc(sizeof(char*) * (count + 1));
+  for (uint32_t i = 0; i < count; i++) {
+    const char *name = NULL;
+    int k = 0;
+    if (limage_u32_read(im, &len) && (name = limage_bytes(im, len)))
+      for (; lbuiltins[k].name; k++)
+        if (strlen(lbuiltins[k].name) == len && ! memcmp(lbuiltins[k].name, name, len))
+          break;
+
+    if (! lbuiltins[k].name || ! name) {
+      free(funs);
+      free(syms);
+      return NULL;
+    }
+    syms[i] = lbuiltins[k].name;
+    funs[i] = lbuiltins[k].func;
+  }
+
+  const char *grammar = NULL;
+  lgrammar *g = NULL;
+  if (limage_u32_read(im, &len) && (grammar = limage_bytes(im, len)))
+    g = minilisp_grammar_get(grammar, len);
+  if (! g) {
+    free(funs);
+    free(syms);
+    return NULL;
+  }
+
+  lenv *e = lenv_new(g);
+  lenv_clear(e);
+  e->count = count;
+  e->syms = syms;
+  e->funs = funs;
+  e->parallel_threshold = threshold;
+  minilisp_set_print_limits(e, depth <= INT_MAX ? depth : INT_MAX,
+      elements <= LONG_MAX ? elements : LONG_MAX, bytes <= SIZE_MAX ? bytes : SIZE_MAX);
+  return e;
+}
+
+lenv *minilisp_load_image(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  // the parsers are rebuilt straight from the mapped file
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  limage im = { data, st.st_size, 0 };
+  lenv *e = limage_load(&im);
+  munmap(data, st.st_size);
+  return e;
+}
+
+// Binary form of values, for handing results to other programs without
+// printing and parsing them again:
+//
+//   'L', version, number of symbols, symbols, value
+//
+// Lengths, counts and indices are unsigned LEB128 varints, numbers are raw
+// 8 byte IEEE doubles in host byte order. Every symbol and builtin name is
+// stored once in the symbol table and referred to by index. A value is a
+// tag byte followed by:
+//
+//   LBIN_NUM    the double
+//   LBIN_ERR    length, bytes
+//   LBIN_SYM    symbol index
+//   LBIN_FUN    symbol index of the builtin's name
+//   LBIN_SEXPR  count, values
+//   LBIN_QEXPR  count, values
+//   LBIN_NUMS   count, doubles; a q-expression of numbers only
+//   LBIN_MAT    rows, cols, rows * cols doubles
+enum { LBIN_NUM, LBIN_ERR, LBIN_SYM, LBIN_FUN, LBIN_SEXPR, LBIN_QEXPR, LBIN_NUMS, LBIN_MAT };
+
+#define LBIN_MAGIC 'L'
+#define LBIN_VERSION 1
+
+// lists may nest at most this deep, so that crafted data can't run the
+// reader out of stack; deeper values aren't written either
+#define LBIN_MAX_DEPTH 1024
+
+// symbols already in the table, by hash
+typedef struct {
+  char **syms;
+  int count;
+  int *slots;    // index + 1 into syms, 0 for free slots
+  int size;
+} lsymtab;
+
+unsigned int lsym_hash(const char *s) {
+  unsigned int h = 2166136261u;
+  while (*s)
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  return h;
+}
+
+int lsymtab_index(lsymtab *t, char *sym) {
+  // keep the table at most half full
+  if (t->count * 2 >= t->size) {
+    int size = t->size ? t->size * 2 : 64;
+    int *slots = calloc(size, sizeof(int));
+    for (int i = 0; i < t->size; i++) {
+      if (! t->slots[i])
+        continue;
+      unsigned int h = lsym_hash(t->syms[t->slots[i] - 1]) & (size - 1);
+      while (slots[h])
+        h = (h + 1) & (size - 1);
+      slots[h] = t->slots[i];
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->size = size;
+  }
+
+  unsigned int h = lsym_hash(sym) & (t->size - 1);
+  while (t->slots[h]) {
+    if (! strcmp(t->syms[t->slots[h] - 1], sym))
+      return t->slots[h] - 1;
+    h = (h + 1) & (t->size - 1);
+  }
+
+  t->count++;
+  t->syms = realloc(t->syms, sizeof(char*) * t->count);
+  t->syms[t->count - 1] = sym;
+  t->slots[h] = t->count;
+  return t->count - 1;
+}
+
+void lbin_varint(lbuf *b, uint64_t x) {
+  char buf[10];
+  int n = 0;
+  while (x >= 0x80) {
+    buf[n++] = (char)(x | 0x80);
+    x >>= 7;
+  }
+  buf[n++] = (char)x;
+  lbuf_write(b, buf, n);
+}
+
+char *lbuiltin_name(lbuiltin f) {
+  for (int i = 0; lbuiltins[i].name; i++)
+    if (lbuiltins[i].func == f)
+      return lbuiltins[i].name;
+  return NULL;
+}
+
+// 0 if v holds something that has no binary form, depth is the number of
+// lists v is in
+int lbin_write(lbuf *b, lsymtab *t, lval *v, int depth) {
+  switch (v->type) {
+    case LVAL_NUM:
+      lbuf_putc(b, LBIN_NUM);
+      lbuf_write(b, (char*)&v->num, sizeof(double));
+      return 1;
+    case LVAL_ERR:
+      lbuf_putc(b, LBIN_ERR);
+      lbin_varint(b, strlen(v->err));
+      lbuf_puts(b, v->err);
+      return 1;
+    case LVAL_SYM:
+      lbuf_putc(b, LBIN_SYM);
+      lbin_varint(b, lsymtab_index(t, v->sym));
+      return 1;
+    case LVAL_FUN: {
+      char *name = lbuiltin_name(v->fun);
+      if (! name)
+        return 0;
+      lbuf_putc(b, LBIN_FUN);
+      lbin_varint(b, lsymtab_index(t, name));
+      return 1;
+    }
+    case LVAL_MAT:
+      lbuf_putc(b, LBIN_MAT);
+      lbin_varint(b, v->rows);
+      lbin_varint(b, v->cols);
+      lbuf_write(b, (char*)v->mat, sizeof(double) * v->rows * v->cols);
+      return 1;
+  }
+
+  // lists of numbers are written as one run of doubles
+  if (v->type == LVAL_QEXPR && v->count > 0 && lval_is_numeric(v)) {
+    lbuf_putc(b, LBIN_NUMS);
+    lbin_varint(b, v->count);
+    lbuf_reserve(b, sizeof(double) * v->count);
+    for (int i = 0; i < v->count; i++) {
+      memcpy(b->data + b->len, &v->cell[i]->num, sizeof(double));
+      b->len += sizeof(double);
+    }
+    b->data[b->len] = '\0';
+    return 1;
+  }
+
+  if (depth == LBIN_MAX_DEPTH)
+    return 0;
+  lbuf_putc(b, v->type == LVAL_SEXPR ? LBIN_SEXPR : LBIN_QEXPR);
+  lbin_varint(b, v->count);
+  for (int i = 0; i < v->count; i++)
+    if (! lbin_write(b, t, v->cell[i], depth + 1))
+      return 0;
+  return 1;
+}
+
+char *minilisp_serialize(lval *v, size_t *size) {
+  lsymtab t = { NULL, 0, NULL, 0 };
+  lbuf body;
+  lbuf_init(&body, NULL);
+
+  int ok = lbin_write(&body, &t, v, 0);
+
+  // the symbol table goes in front, now that it is complete
+  lbuf out;
+  lbuf_init(&out, NULL);
+  if (ok) {
+    lbuf_reserve(&out, body.len + 16);
+    lbuf_putc(&out, LBIN_MAGIC);
+    lbuf_putc(&out, LBIN_VERSION);
+    lbin_varint(&out, t.count);
+    for (int i = 0; i < t.count; i++) {
+      lbin_varint(&out, strlen(t.syms[i]));
+      lbuf_puts(&out, t.syms[i]);
+    }
+    lbuf_write(&out, body.data, body.len);
+    *size = out.len;
+  }
+
+  free(t.syms);
+  free(t.slots);
+  lbuf_free(&body);
+  return out.data;
+}
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  const char **syms;   // point into the data, lengths in sym_lens
+  uint64_t *sym_lens;
+  uint64_t syms_num;
+  int depth;           // lists being read
+} lbin;
+
+int lbin_read_varint(lbin *in, uint64_t *x) {
+  *x = 0;
+  for (int shift = 0; shift < 64 && in->pos < in->len; shift += 7) {
+    unsigned char c = in->data[in->pos++];
+    *x |= (uint64_t)(c & 0x7f) << shift;
+    if (! (c & 0x80))
+      return 1;
+  }
+  return 0;
+}
+
+// read n doubles into out, 0 if the data is too short
+int lbin_read_doubles(lbin *in, double *out, uint64_t n) {
+  if (n > (in->len - in->pos) / sizeof(double))
+    return 0;
+  memcpy(out, in->data + in->pos, sizeof(double) * n);
+  in->pos += sizeof(double) * n;
+  return 1;
+}
+
+// the next value, NULL if the data is malformed
+lval *lbin_read(lbin *in) {
+  uint64_t n, m;
+  if (in->pos >= in->len)
+    return NULL;
+
+  lval *v = NULL;
+  switch (in->data[in->pos++]) {
+    case LBIN_NUM: {
+      double x;
+      if (lbin_read_doubles(in, &x, 1))
+        v = lval_num(x);
+      break;
+    }
+    case LBIN_ERR:
+      if (! lbin_read_varint(in, &n) || n > in->len - in->pos)
+        break;
+      v = lval_err("");
+      v->err = realloc(v->err, n + 1);
+      memcpy(v->err, in->data + in->pos, n);
+      v->err[n] = '\0';
+      in->pos += n;
+      break;
+    case LBIN_SYM:
+      if (! lbin_read_varint(in, &n) || n >= in->syms_num)
+        break;
+      v = lval_sym("");
+      v->sym = realloc(v->sym, in->sym_lens[n] + 1);
+      memcpy(v->sym, in->syms[n], in->sym_lens[n]);
+      v->sym[in->sym_lens[n]] = '\0';
+      break;
+    case LBIN_FUN:
+      if (! lbin_read_varint(in, &n) || n >= in->syms_num)
+        break;
+      for (int i = 0; lbuiltins[i].name; i++)
+        if (strlen(lbuiltins[i].name) == in->sym_lens[n] &&
+            ! memcmp(lbuiltins[i].name, in->syms[n], in->sym_lens[n]))
+          v = lval_fun(lbuiltins[i].func);
+      break;
+    case LBIN_NUMS:
+      // every number takes 8 bytes, which also bounds the count
+      if (! lbin_read_varint(in, &n) || n > (in->len - in->pos) / sizeof(double))
+        break;
+      v = lval_qexpr();
+      v->cell = malloc(sizeof(lval*) * n);
+      for (uint64_t i = 0; i < n; i++) {
+        double x;
+        memcpy(&x, in->data + in->pos, sizeof(double));
+        in->pos += sizeof(double);
+        v->cell[v->count++] = lval_num(x);
+      }
+      break;
+    case LBIN_MAT:
+      if (! lbin_read_varint(in, &n) || ! lbin_read_varint(in, &m) ||
+          n == 0 || m == 0 || n > INT32_MAX || m > INT32_MAX ||
+          n * m / m != n || n * m > (in->len - in->pos) / sizeof(double))
+        break;
+      v = lval_mat(n, m);
+      lbin_read_doubles(in, v->mat, n * m);
+      break;
+    case LBIN_SEXPR:
+    case LBIN_QEXPR: {
+      int sexpr = in->data[in->pos - 1] == LBIN_SEXPR;
+      // every value takes at least a byte
+      if (in->depth == LBIN_MAX_DEPTH || ! lbin_read_varint(in, &n) || n > in->len - in->pos)
+        break;
+      v = sexpr ? lval_sexpr() : lval_qexpr();
+      v->cell = malloc(sizeof(lval*) * n);
+      in->depth++;
+      for (uint64_t i = 0; i < n; i++) {
+        lval *x = lbin_read(in);
+        if (! x) {
+          lval_del(v);
+          return NULL;
+        }
+        v->cell[v->count++] = x;
+      }
+      in->depth--;
+      break;
+    }
+  }
+
+  return v;
+}
+
+lval *minilisp_deserialize(const char *data, size_t size) {
+  lbin in = { (const unsigned char*)data, size, 0, NULL, NULL, 0, 0 };
+  if (size < 2 || data[0] != LBIN_MAGIC || data[1] != LBIN_VERSION)
+    return NULL;
+  in.pos = 2;
+
+  // the symbols are only pointed at, the data may be read-only
+  uint64_t n;
+  if (! lbin_read_varint(&in, &n) || n > size - in.pos)
+    return NULL;
+  in.syms = malloc(sizeof(char*) * (n + 1));
+  in.sym_lens = malloc(sizeof(uint64_t) * (n + 1));
+  for (in.syms_num = 0; in.syms_num < n; in.syms_num++) {
+    uint64_t len;
+    if (! lbin_read_varint(&in, &len) || len > size - in.pos)
+      break;
+    in.syms[in.syms_num] = data + in.pos;
+    in.sym_lens[in.syms_num] = len;
+    in.pos += len;
+  }
+
+  lval *v = in.syms_num == n ? lbin_read(&in) : NULL;
+
+  // trailing bytes mean it wasn't one value after all
+  if (v && in.pos != size) {
+    lval_del(v);
+    v = NULL;
+  }
+
+  free(in.syms);
+  free(in.sym_lens);
+  return v;
+}
@@ -0,0 +1,100 @@
+#ifndef minilisp_h
+#define minilisp_h
+
+#include <stddef.h>
+
+// Minilisp as a library.
+//
+// A context (lenv) holds everything evaluation needs; contexts share one
+// grammar that is compiled the first time a context is created. A context
+// is used by one thread at a time, different contexts may be used from
+// different threads at once. Nothing here reads stdin or writes stdout
+// unless given a stream.
+//
+//   lenv *e = minilisp_new();
+//   lval *v = minilisp_eval(e, "+ 1 2", 5);
+//   if (minilisp_type(v) == LVAL_NUM) ... minilisp_number(v) ...
+//   minilisp_free(v);
+//   minilisp_delete(e);
+//
+// The shared library exports only the functions declared here.
+
+#if defined(__GNUC__)
+#define MINILISP_API __attribute__((visibility("default")))
+#else
+#define MINILISP_API
+#endif
+
+typedef struct lval lval;
+typedef struct lenv lenv;
+
+// possible types of lval
+enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_MAT };
+
+// contexts
+MINILISP_API lenv *minilisp_new(void);
+MINILISP_API void minilisp_delete(lenv *e);
+
+// forget the settings and statistics, as if the context was just created
+MINILISP_API void minilisp_reset(lenv *e);
+
+// Images hold a context, its settings included, with the compiled grammar,
+// so that loading one skips compiling the grammar. Loading returns a new
+// context, NULL if the file isn't an image of this version; saving returns
+// 0 on failure.
+MINILISP_API int minilisp_save_image(lenv *e, const char *path);
+MINILISP_API lenv *minilisp_load_image(const char *path);
+
+// the grammar compiled from scratch as an mpc image (see mpc_image_save),
+// which the build embeds so that contexts don't compile it at startup
+MINILISP_API char *minilisp_grammar_image(size_t *size);
+
+// evaluate s-expression arguments of at least this many nodes in parallel
+// on the task pool (see task.h), 0 disables it
+MINILISP_API void minilisp_set_parallel(lenv *e, int nodes);
+
+// Limit how much of each result is printed where the context prints its
+// results like the REPL does: lists nested deeper than depth print as
+// (...), lists print at most elements elements (rows and columns for
+// matrices), and once about bytes are written the rest is elided. All 0,
+// the default, prints results in full.
+MINILISP_API void minilisp_set_print_limits(lenv *e, int depth, long elements, size_t bytes);
+
+// number of inputs evaluated and of those that ended in an error
+MINILISP_API long minilisp_exprs(lenv *e);
+MINILISP_API long minilisp_errors(lenv *e);
+
+// Evaluate the program in input[0..len). The result belongs to the caller;
+// parse errors come back as LVAL_ERR with the parser's message.
+MINILISP_API lval *minilisp_eval(lenv *e, const char *input, size_t len);
+
+// printed form of v, to be freed by the caller
+MINILISP_API char *minilisp_format(lval *v);
+
+// Values are opaque, these look into them. Asking a value for something of
+// another type gives 0 or NULL.
+MINILISP_API int minilisp_type(const lval *v);
+MINILISP_API double minilisp_number(const lval *v);
+// the message of an error, the name of a symbol
+MINILISP_API const char *minilisp_string(const lval *v);
+// elements of an s- or q-expression; they belong to v
+MINILISP_API int minilisp_length(const lval *v);
+MINILISP_API const lval *minilisp_element(const lval *v, int i);
+// a matrix as rows * cols numbers in row-major order
+MINILISP_API int minilisp_rows(const lval *v);
+MINILISP_API int minilisp_cols(const lval *v);
+MINILISP_API const double *minilisp_matrix(const lval *v);
+
+// free a value returned by the library
+MINILISP_API void minilisp_free(lval *v);
+
+// Compact binary form of v for exchanging values between programs, NULL
+// if v holds a function that isn't a builtin or lists nested more than
+// 1024 deep. The result belongs to the caller.
+MINILISP_API char *minilisp_serialize(lval *v, size_t *size);
+
+// the value serialized in data[0..size), NULL if the data is malformed;
+// data is only read, so it may be a read-only mapping
+MINILISP_API lval *minilisp_deserialize(const char *data, size_t size);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef minilisp_internal_h
+#define minilisp_internal_h
+
+#include <stdio.h>
+
+#include "minilisp.h"
+
+// The parts of minilisp that the programs built with it (prompt, tests and
+// benchmarks) use besides the API in minilisp.h. They link the static
+// library; none of this is exported from the shared one.
+
+typedef lval* (*lbuiltin)(lenv*, lval*);
+
+struct lval {
+  int type;
+  double num;
+
+  // Error and symbol are represented by strings
+  char *err;
+  char *sym;
+  // Function is represented by a function pointer
+  lbuiltin fun;
+
+  // A list of lval and the number of elements in the list
+  int count;
+  struct lval** cell;
+
+  // Matrix is a dense row-major array of rows * cols numbers
+  int rows;
+  int cols;
+  double *mat;
+
+  // link in the free list of unused lvals
+  struct lval *next;
+};
+
+void lval_del(lval *v);
+
+// Output buffer the printers append to. With a stream attached it writes
+// itself out in large chunks, otherwise it just grows in memory.
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  FILE *out;
+  // bytes written out to the stream so far
+  size_t flushed;
+} lbuf;
+
+void lbuf_init(lbuf *b, FILE *out);
+void lbuf_free(lbuf *b);
+void lbuf_flush(lbuf *b);
+void lbuf_write(lbuf *b, const char *s, size_t n);
+void lbuf_putc(lbuf *b, char c);
+void lbuf_puts(lbuf *b, const char *s);
+void lbuf_printf(lbuf *b, const char *fmt, ...);
+
+// How much of a value to print, see minilisp_set_print_limits. Elided
+// parts are marked with "...".
+typedef struct {
+  int depth;
+  long elements;
+  size_t bytes;
+} lprint_limits;
+
+void lval_print(lbuf *b, lval *v);
+void lval_print_limited(lbuf *b, lval *v, const lprint_limits *l);
+void lval_println(lbuf *b, lval *v);
+
+// Numbers are printed with the fewest significant digits that read back as
+// the same double. lnum_digits gives those digits of a positive finite x,
+// not NUL terminated, and the exponent of the first one so that
+// x = d.ddd * 10^exp; lnum_format writes x as it is printed into s, which
+// has room for LNUM_MAX bytes.
+enum { LNUM_MAX = 400 };
+
+int lnum_digits(double x, char *digits, int *exp);
+int lnum_format(char *s, double x);
+
+// parse, evaluate and print everything in the NUL terminated input like
+// the REPL does; parse errors are reported as if input started at the
+// given row and column of the file. Returns 0 on a parse error.
+int eval_print(lenv *e, lbuf *out, char *filename, char *input, int row, int col);
+
+// the same for input[0..len), which needs no NUL terminator
+int eval_print_n(lenv *e, lbuf *out, char *filename, const char *input, size_t len, int row, int col);
+
+// Evaluate v, consuming it. Nested elementwise arithmetic such as
+// (+ (* a b) c) is run as one fused loop over the elements, unless fuse
+// is 0; both give the same results.
+lval *lval_eval_in(lenv *e, lval *v, int fuse);
+
+// The program in input[0..len) as an s-expression, NULL if it doesn't
+// parse, read in turn: through an mpc_ast_t walked by lval_read, with the
+// reader grammar building lvals while parsing, and by the structural
+// scanner. Evaluation tries the scanner and then the reader grammar.
+lval *lread_ast(lenv *e, const char *input, size_t len);
+lval *lread_mpc(lenv *e, const char *input, size_t len);
+lval *lscan_read(const char *s, size_t len);
+
+// the scanner's first pass alone: the number of brackets and tokens
+size_t lscan_count(const char *s, size_t len);
+
+// c += a * b for an n x p matrix a and a p x m matrix b, on the task pool
+// when it is large enough
+void lmat_mul_parallel(double *a, double *b, double *c, int n, int p, int m);
+
+#endif
@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minilisp.h"
+
+// Writes the compiled grammar as a C header that minilisp.c embeds when
+// built with MINILISP_GRAMMAR_IMAGE.
+int main() {
+  size_t size;
+  unsigned char *image = (unsigned char*)minilisp_grammar_image(&size);
+  if (! image) {
+    fprintf(stderr, "mkgrammar: the grammar can't be saved as an image\n");
+    return 1;
+  }
+
+  printf("// generated by mkgrammar, do not edit\n");
+  printf("static const unsigned char lgrammar_image[] = {");
+  for (size_t i = 0; i < size; i++)
+    printf("%s%u,", i % 16 ? " " : "\n  ", image[i]);
+  printf("\n};\n");
+  printf("static const size_t lgrammar_image_size = %zu;\n", size);
+
+  free(image);
+  return 0;
+}
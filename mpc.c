@@ -1,5 +1,30 @@
+/*
+** Regular files are memory mapped where the
+** system has mmap. Define MPC_NO_MMAP to always
+** read them through stdio instead.
+*/
+
+#if !defined(MPC_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define MPC_MMAP
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #include "mpc.h"
 
+#include <float.h>
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#define MPC_ATOMICS
+#include <stdatomic.h>
+#endif
+
+#ifdef MPC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 /*
 ** State Type
 */
@@ -116,13 +141,18 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
+/*
+** The buffer is passed in by the caller
+** so that errors can be printed from
+** several threads at once.
+*/
 
-static char *mpc_err_char_unescape(char c) {
+static char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
   
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
   char_unescape_buffer[2] = '\'';
+  char_unescape_buffer[3] = '\0';
   
   switch (c) {
     
@@ -145,6 +175,7 @@ static char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
   
   char *buffer = calloc(1, 1024);
+  char unescaped[4];
   int max = 1023;
   int pos = 0; 
   int i;
@@ -174,7 +205,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->state.next));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->state.next, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -273,16 +304,22 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** In mpc the input type has three modes of 
 ** operation: String, File and Pipe.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** String is easy. The caller's buffer is read
+** in place up to its length, so it needs no NUL
+** terminator and must stay unchanged until the
+** parse is over. The cursor can jump around at
+** will making backtracking easy.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into 
 ** memory but backtracking can still be achieved
 ** by seeking in the file at different positions.
 **
+** A File that is a regular file is instead
+** mapped into memory where possible and then
+** read exactly like a String, so failed matches
+** and rewinds don't each cost a seek.
+**
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and 
 ** only support a single character lookahead at 
@@ -292,7 +329,10 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 **
 ** This means that if we are requested to seek
 ** back we can simply start reading from the
-** buffer instead of the input.
+** buffer instead of the input. The buffer is a
+** list of fixed size chunks, so that appending
+** and looking up a position take constant time,
+** and it is released as soon as no mark is left.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -303,7 +343,8 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
 };
 
 typedef struct {
@@ -312,17 +353,23 @@ typedef struct {
   char *filename;  
   mpc_state_t state;
   
-  char *string;
-  char *buffer;
+  const char *string;
+  size_t length;
   FILE *file;
   
+  char **chunks;
+  int chunks_num;
+  int chunks_max;
+  int buffer_start;
+  int buffered;
+  
   int backtrack;
   int marks_num;
   mpc_state_t* marks;
   
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string, size_t length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -332,9 +379,13 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
+  i->string = string;
+  i->length = length;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_max = 0;
+  i->buffer_start = 0;
+  i->buffered = 0;
   i->file = NULL;
   
   i->backtrack = 1;
@@ -355,7 +406,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_max = 0;
+  i->buffer_start = 0;
+  i->buffered = 0;
   i->file = pipe;
   
   i->backtrack = 1;
@@ -376,7 +432,12 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_max = 0;
+  i->buffer_start = 0;
+  i->buffered = 0;
   i->file = file;
   
   i->backtrack = 1;
@@ -386,12 +447,82 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   return i;
 }
 
+/* NULL if the file can't be mapped */
+static mpc_input_t *mpc_input_new_mmap(const char *filename, FILE *file) {
+  
+#ifdef MPC_MMAP
+  
+  struct stat st;
+  void *map;
+  mpc_input_t *i;
+  
+  if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) { return NULL; }
+  
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (map == MAP_FAILED) { return NULL; }
+  posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+  
+  i = mpc_input_new_string(filename, map, st.st_size);
+  i->type = MPC_INPUT_MMAP;
+  return i;
+  
+#else
+  
+  return NULL;
+  
+#endif
+  
+}
+
+enum { MPC_INPUT_CHUNK = 4096 };
+
+static void mpc_input_buffer_clear(mpc_input_t *i) {
+  int j;
+  for (j = 0; j < i->chunks_num; j++) { free(i->chunks[j]); }
+  free(i->chunks);
+  i->chunks = NULL;
+  i->chunks_num = 0;
+  i->chunks_max = 0;
+  i->buffered = 0;
+}
+
+/*
+** The buffer holds the input read from the first
+** mark on. Once no mark is left it is only read
+** up to its end and then released.
+*/
+
+static int mpc_input_buffer_in_range(mpc_input_t *i) {
+  return i->buffered > 0 && i->state.pos < i->buffer_start + i->buffered;
+}
+
+static char mpc_input_buffer_get(mpc_input_t *i) {
+  int j = i->state.pos - i->buffer_start;
+  return i->chunks[j / MPC_INPUT_CHUNK][j % MPC_INPUT_CHUNK];
+}
+
+static void mpc_input_buffer_add(mpc_input_t *i, char c) {
+  
+  if (i->buffered == i->chunks_num * MPC_INPUT_CHUNK) {
+    if (i->chunks_num == i->chunks_max) {
+      i->chunks_max = i->chunks_max ? i->chunks_max * 2 : 4;
+      i->chunks = realloc(i->chunks, sizeof(char*) * i->chunks_max);
+    }
+    i->chunks[i->chunks_num++] = malloc(MPC_INPUT_CHUNK);
+  }
+  
+  i->chunks[i->buffered / MPC_INPUT_CHUNK][i->buffered % MPC_INPUT_CHUNK] = c;
+  i->buffered++;
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_PIPE) { mpc_input_buffer_clear(i); }
+#ifdef MPC_MMAP
+  if (i->type == MPC_INPUT_MMAP) { munmap((void*)i->string, i->length); }
+#endif
   
   free(i->marks);
   free(i);
@@ -408,8 +539,8 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
   i->marks[i->marks_num-1] = i->state;
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  if (i->type == MPC_INPUT_PIPE && i->buffered == 0) {
+    i->buffer_start = i->state.pos;
   }
   
 }
@@ -421,9 +552,8 @@ static void mpc_input_unmark(mpc_input_t *i) {
   i->marks_num--;
   i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0 && !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_clear(i);
   }
   
 }
@@ -441,33 +571,27 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
-}
-
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+  if ((i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) && (size_t)i->state.pos >= i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+  if (i->type == MPC_INPUT_PIPE && !mpc_input_buffer_in_range(i) && feof(i->file)) { return 1; }
   return 0;
 }
 
 static char mpc_input_getc(mpc_input_t *i) {
   
-  char c;
+  char c = '\0';
   switch (i->type) {
     
-    case MPC_INPUT_STRING: c = i->string[i->state.pos]; break;
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
+      if ((size_t)i->state.pos < i->length) { c = i->string[i->state.pos]; }
+    break;
+    
     case MPC_INPUT_FILE: c = fgetc(i->file); break;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         c = mpc_input_buffer_get(i);
       } else {
         c = getc(i->file);
@@ -484,12 +608,11 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: break;
+    case MPC_INPUT_MMAP: break;
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
     case MPC_INPUT_PIPE:
       
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
+      if (mpc_input_buffer_in_range(i)) {
         break;
       } else {
         ungetc(c, i->file); 
@@ -504,17 +627,21 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
+      i->marks_num > 0 &&
       !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    mpc_input_buffer_add(i, c);
   }
 
   i->state.pos++;
   i->state.col++;
   
+  if (i->type == MPC_INPUT_PIPE &&
+      i->marks_num == 0 &&
+      i->buffered > 0 &&
+      !mpc_input_buffer_in_range(i)) {
+    mpc_input_buffer_clear(i);
+  }
+  
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
@@ -557,16 +684,17 @@ static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+/* a NUL in the input is never in a set, strchr would find the terminator */
 static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return x != '\0' && strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { i->state.next = '\0'; return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+  return x == '\0' || strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -577,14 +705,11 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   
-  char *co = NULL;
   const char *x = c;
 
   mpc_input_mark(i);
   while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
+    if (!mpc_input_char(i, *x, NULL)) {
       mpc_input_rewind(i);
       return 0;
     }
@@ -592,8 +717,10 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (o) {
+    *o = malloc(strlen(c) + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
@@ -668,13 +795,70 @@ struct mpc_parser_t {
   char retained;
   char *name;
   char type;
+  char span;
+  mpc_apply_t memo_copy;
+  mpc_dtor_t memo_dx;
+  char analysed;
+  unsigned long generation;
+  char nullable;
+  unsigned char first[32];
   mpc_pdata_t data;
 };
 
+/*
+** The first sets of a parser depend on those of every
+** parser below it, so redefining a parser that has been
+** analysed makes the sets of the parsers above it stale.
+** Parsers don't know what is above them; instead every
+** such redefinition starts a new generation, and only
+** sets from the current one are used, see mpc_analyse.
+** Grammars analysed before then go without dispatch
+** until they are analysed again.
+**
+** Parses on other threads read the generation while a
+** parser is redefined, so it is atomic where C11 atomics
+** are available. That only keeps the counter itself
+** sound: redefining a parser still changes the parser,
+** so callers must not parse with a grammar on other
+** threads while defining, undefining or analysing it.
+*/
+
+#ifdef MPC_ATOMICS
+static atomic_ulong mpc_generation = 0;
+#define MPC_GENERATION_GET() atomic_load(&mpc_generation)
+#define MPC_GENERATION_NEXT() atomic_fetch_add(&mpc_generation, 1)
+#else
+static unsigned long mpc_generation = 0;
+#define MPC_GENERATION_GET() mpc_generation
+#define MPC_GENERATION_NEXT() mpc_generation++
+#endif
+
+static void mpc_analysis_stale(mpc_parser_t *p) {
+  if (p->analysed) { MPC_GENERATION_NEXT(); }
+  p->analysed = 0;
+}
+
 /*
 ** Stack Type
 */
 
+typedef struct {
+  mpc_parser_t *p;
+  int pos;
+  char backtrack;
+  char success;
+  char kept;
+  mpc_state_t end;
+  mpc_result_t result;
+  mpc_err_t *err;
+} mpc_memo_t;
+
+typedef struct {
+  int depth;
+  int pos;
+  mpc_err_t *err;
+} mpc_memo_frame_t;
+
 typedef struct {
 
   int parsers_num;
@@ -689,6 +873,24 @@ typedef struct {
   
   mpc_err_t *err;
   
+  /* Depth of the parser being matched as a span, and where it started */
+  int span;
+  long span_pos;
+  
+  /* Packrat memo and the memoized parsers being matched */
+  int memo_num;
+  int memo_slots;
+  mpc_memo_t *memo;
+  
+  int frames_num;
+  int frames_slots;
+  mpc_memo_frame_t *frames;
+  
+  /* Whether `or` may skip alternatives, and if it did */
+  int dispatch;
+  int skipped;
+  unsigned long generation;
+  
 } mpc_stack_t;
 
 static mpc_stack_t *mpc_stack_new(const char *filename) {
@@ -706,19 +908,39 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   
   s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
   
+  s->span = 0;
+  s->span_pos = 0;
+  
+  s->memo_num = 0;
+  s->memo_slots = 0;
+  s->memo = NULL;
+  
+  s->frames_num = 0;
+  s->frames_slots = 0;
+  s->frames = NULL;
+  
+  s->dispatch = 0;
+  s->skipped = 0;
+  
   return s;
 }
 
 static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
   mpc_err_t *errs[2];
+  if (e == NULL) { return; }
+  if (s->err == NULL) { s->err = e; return; }
   errs[0] = s->err;
   errs[1] = e;
   s->err = mpc_err_or(errs, 2);
 }
 
+static void mpc_stack_memo_delete(mpc_stack_t *s);
+
 static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
   int success = s->returns[0];
   
+  mpc_stack_memo_delete(s);
+  
   if (success) {
     r->output = s->results[0].output;
     mpc_err_delete(s->err);
@@ -731,6 +953,8 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
   free(s->states);
   free(s->results);
   free(s->returns);
+  free(s->memo);
+  free(s->frames);
   free(s);
   
   return success;
@@ -868,17 +1092,240 @@ static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
 }
 
 static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+  mpc_val_t *x;
+  if (s->span) { mpc_stack_popr_n(s, n); return NULL; }
+  x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
   mpc_stack_popr_n(s, n);
   return x;
 }
 
-static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
+/*
+** Parsers marked as spans output exactly the text
+** they consume. When reading from memory they are
+** matched without building any values and their
+** result is copied out of the input once they are
+** done, which saves a malloc per character and the
+** folding of all those strings.
+*/
+
+static int mpc_stack_span_begin(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  if (s->span || !p->span) { return 0; }
+  if (i->type != MPC_INPUT_STRING && i->type != MPC_INPUT_MMAP) { return 0; }
+  s->span = s->parsers_num;
+  s->span_pos = i->state.pos;
+  return 1;
+}
+
+static void mpc_stack_span_end(mpc_stack_t *s, mpc_input_t *i) {
+  
+  char *x;
+  size_t l;
+  
+  if (!s->span || s->parsers_num >= s->span) { return; }
+  s->span = 0;
+  
+  if (!s->returns[s->results_num-1]) { return; }
+  l = i->state.pos - s->span_pos;
+  x = malloc(l + 1);
+  memcpy(x, i->string + s->span_pos, l);
+  x[l] = '\0';
+  s->results[s->results_num-1].output = x;
+}
+
+/*
+** Packrat parsing. Retained parsers given a copy
+** function with `mpc_memoize` remember their result
+** at each position of a string input, so however
+** much the grammar backtracks a rule is matched at
+** most twice at each position.
+**
+** Outputs belong to whoever they are passed to, so
+** a reused output has to be a copy. To avoid copying
+** the many that are never reused, an output is only
+** kept once the rule matched at that position a
+** second time; failures are kept straight away.
+** Errors merged into the stack while the rule ran
+** are kept too so that reusing a result reports the
+** same errors as matching it again would.
+*/
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  
+  int i;
+  mpc_err_t *e = malloc(sizeof(mpc_err_t));
+  e->state = x->state;
+  e->filename = malloc(strlen(x->filename) + 1);
+  strcpy(e->filename, x->filename);
+  e->failure = NULL;
+  if (x->failure) {
+    e->failure = malloc(strlen(x->failure) + 1);
+    strcpy(e->failure, x->failure);
+  }
+  e->expected_num = x->expected_num;
+  e->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (i = 0; i < x->expected_num; i++) {
+    e->expected[i] = malloc(strlen(x->expected[i]) + 1);
+    strcpy(e->expected[i], x->expected[i]);
+  }
+  return e;
+}
+
+static int mpc_stack_memo_slot(mpc_stack_t *s, mpc_parser_t *p, int pos, int backtrack) {
+  
+  size_t h = ((size_t)p >> 4) * 31 + (size_t)pos * 2 + (size_t)backtrack;
+  int j = (int)((h * 2654435761u) & (size_t)(s->memo_slots-1));
+  
+  while (s->memo[j].p && !(s->memo[j].p == p && s->memo[j].pos == pos && s->memo[j].backtrack == backtrack)) {
+    j = (j+1) & (s->memo_slots-1);
+  }
+  
+  return j;
+}
+
+static void mpc_stack_memo_reserve(mpc_stack_t *s) {
+  
+  int i, j, slots = s->memo_slots;
+  mpc_memo_t *memo = s->memo;
+  
+  if (s->memo_num * 2 < s->memo_slots) { return; }
+  
+  s->memo_slots = slots ? slots * 2 : 256;
+  s->memo = calloc(s->memo_slots, sizeof(mpc_memo_t));
+  for (i = 0; i < slots; i++) {
+    if (!memo[i].p) { continue; }
+    j = mpc_stack_memo_slot(s, memo[i].p, memo[i].pos, memo[i].backtrack);
+    s->memo[j] = memo[i];
+  }
+  free(memo);
+}
+
+static void mpc_stack_memo_delete(mpc_stack_t *s) {
+  
+  int i;
+  mpc_memo_t *m;
+  
+  for (i = 0; i < s->memo_slots; i++) {
+    m = &s->memo[i];
+    if (!m->p) { continue; }
+    if (m->success && m->result.output) { m->p->memo_dx(m->result.output); }
+    if (!m->success) { mpc_err_delete(m->result.error); }
+    if (m->err) { mpc_err_delete(m->err); }
+  }
+}
+
+static int mpc_stack_memo_begin(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  
+  int j;
+  mpc_memo_t *m;
+  mpc_memo_frame_t *f;
+  
+  if (i->type != MPC_INPUT_STRING && i->type != MPC_INPUT_MMAP) { return 0; }
+  
+  if (s->memo_slots) {
+    j = mpc_stack_memo_slot(s, p, i->state.pos, i->backtrack > 0);
+    m = &s->memo[j];
+    if (m->p && m->kept) {
+      s->parsers_num--;
+      mpc_stack_parsers_reserve_less(s);
+      if (m->success) {
+        mpc_stack_pushr(s, mpc_result_out(m->result.output ? p->memo_copy(m->result.output) : NULL), 1);
+      } else {
+        mpc_stack_pushr(s, mpc_result_err(mpc_err_copy(m->result.error)), 0);
+      }
+      if (m->err) { mpc_stack_err(s, mpc_err_copy(m->err)); }
+      i->state = m->end;
+      return 1;
+    }
+  }
+  
+  s->frames_num++;
+  if (s->frames_num > s->frames_slots) {
+    s->frames_slots = s->frames_slots ? s->frames_slots * 2 : 16;
+    s->frames = realloc(s->frames, sizeof(mpc_memo_frame_t) * s->frames_slots);
+  }
+  f = &s->frames[s->frames_num-1];
+  f->depth = s->parsers_num;
+  f->pos = i->state.pos;
+  f->err = s->err;
+  s->err = NULL;
+  
+  return 0;
+}
+
+static void mpc_stack_memo_end(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  
+  int j;
+  mpc_memo_t *m;
+  mpc_memo_frame_t *f;
+  mpc_err_t *err;
+  mpc_val_t *x;
+  
+  if (!s->frames_num || s->parsers_num >= s->frames[s->frames_num-1].depth) { return; }
+  f = &s->frames[s->frames_num-1];
+  s->frames_num--;
+  
+  err = s->err;
+  s->err = f->err;
+  
+  mpc_stack_memo_reserve(s);
+  j = mpc_stack_memo_slot(s, p, f->pos, i->backtrack > 0);
+  m = &s->memo[j];
+  
+  if (m->p) {
+    /* Matched again, so this time keep the output */
+    x = s->results[s->results_num-1].output;
+    m->result.output = x ? p->memo_copy(x) : NULL;
+    m->kept = 1;
+  } else {
+    m->p = p;
+    m->pos = f->pos;
+    m->backtrack = i->backtrack > 0;
+    m->success = s->returns[s->results_num-1];
+    m->end = i->state;
+    m->err = err ? mpc_err_copy(err) : NULL;
+    x = s->results[s->results_num-1].output;
+    m->kept = !m->success || x == NULL;
+    m->result.output = NULL;
+    if (!m->success) { m->result.error = mpc_err_copy(s->results[s->results_num-1].error); }
+    s->memo_num++;
+  }
+  
+  if (err) { mpc_stack_err(s, err); }
+}
+
+static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, mpc_input_t *i, int n) {
+  
+  int j, k = 0;
+  mpc_err_t *x, **xs = (mpc_err_t**)(&s->results[s->results_num-n]);
+  
+  /* Alternatives skipped by `or` leave no error */
+  for (j = 0; j < n; j++) {
+    if (xs[j]) { xs[k++] = xs[j]; }
+  }
+  
+  x = k ? mpc_err_or(xs, k) : mpc_err_fail(i->filename, i->state, "Incorrect Input");
   mpc_stack_popr_n(s, n);
   return x;
 }
 
+/*
+** An alternative can be skipped when the next character
+** isn't in its first set and it can't match without
+** consuming it, see mpc_analyse. Sets from before the
+** last redefinition of an analysed parser aren't used.
+*/
+
+static int mpc_stack_viable(mpc_stack_t *s, mpc_input_t *i, mpc_parser_t *p) {
+  
+  unsigned char c;
+  
+  if (!s->dispatch || !p->analysed || p->generation != s->generation || p->nullable) { return 1; }
+  if ((size_t)i->state.pos >= i->length) { return 0; }
+  
+  c = (unsigned char)i->string[i->state.pos];
+  return (p->first[c >> 3] >> (c & 7)) & 1;
+}
+
 /*
 ** This is rather pleasant. The core parsing routine
 ** is written in about 200 lines of C.
@@ -901,11 +1348,12 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 */
 
 #define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
-#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
+#define MPC_END() mpc_stack_span_end(stk, i); mpc_stack_memo_end(stk, i, p)
+#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); MPC_END(); continue
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); MPC_END(); continue
 #define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final, int *skipped) {
   
   /* Stack */
   int st = 0;
@@ -914,15 +1362,23 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
   
   /* Variables */
   char *s;
+  char **so;
   mpc_result_t r;
 
   /* Go! */
+  stk->dispatch = *skipped == 0 && (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP);
+  stk->generation = MPC_GENERATION_GET();
   mpc_stack_pushp(stk, init);
   
   while (!mpc_stack_empty(stk)) {
     
     mpc_stack_peepp(stk, &p, &st);
     
+    if (st == 0 && p->memo_copy && mpc_stack_memo_begin(stk, i, p)) { continue; }
+    if (st == 0) { mpc_stack_span_begin(stk, i, p); }
+    s = NULL;
+    so = stk->span ? NULL : &s;
+    
     switch (p->type) {
       
       /* Trivial Parsers */
@@ -930,20 +1386,20 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
       case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
       case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(stk->span ? NULL : p->data.lift.lf());
       case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     
       /* Basic Parsers */
 
       case MPC_TYPE_SOI:       MPC_PRIMATIVE(NULL, mpc_input_soi(i));
       case MPC_TYPE_EOI:       MPC_PRIMATIVE(NULL, mpc_input_eoi(i));
-      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, &s));
-      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, &s));
-      case MPC_TYPE_RANGE:     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-      case MPC_TYPE_ONEOF:     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-      case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
-      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
-      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, so));
+      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, so));
+      case MPC_TYPE_RANGE:     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, so));
+      case MPC_TYPE_ONEOF:     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.x, so));
+      case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, so));
+      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, so));
+      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, so));
     
       /* Application Parsers */
       
@@ -983,6 +1439,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         if (st == 1) {
           mpc_input_backtrack_enable(i);
           mpc_stack_popp(stk, &p, &st);
+          MPC_END();
           continue;
         }
       
@@ -1011,7 +1468,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             MPC_SUCCESS(r.output);
           } else {
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_SUCCESS(stk->span ? NULL : p->data.not.lf());
           }
         }
       
@@ -1072,16 +1529,20 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
-        if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-        if (st <= p->data.or.n) {
-          if (mpc_stack_peekr(stk, &r)) {
-            mpc_stack_popr(stk, &r);
-            mpc_stack_popr_err(stk, st-1);
-            MPC_SUCCESS(r.output);
-          }
-          if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-          if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
+        if (st > 0 && mpc_stack_peekr(stk, &r)) {
+          mpc_stack_popr(stk, &r);
+          mpc_stack_popr_err(stk, st-1);
+          MPC_SUCCESS(r.output);
+        }
+        
+        while (st < p->data.or.n && !mpc_stack_viable(stk, i, p->data.or.xs[st])) {
+          mpc_stack_pushr(stk, mpc_result_err(NULL), 0);
+          stk->skipped = 1;
+          st++;
         }
+        
+        if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+        if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, i, p->data.or.n)); }
       
       case MPC_TYPE_AND:
         
@@ -1107,18 +1568,44 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
     }
   }
   
+  *skipped = stk->skipped;
   return mpc_stack_terminate(stk, final);
   
 }
 
 #undef MPC_CONTINUE
+#undef MPC_END
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMATIVE
 
+/*
+** Skipping alternatives leaves out their errors, which
+** only matter when the parse fails. Failed parses are
+** run again trying every alternative so the error is
+** the same as it always was.
+*/
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  
+  int x, skipped = 0;
+  mpc_state_t start = i->state;
+  
+  x = mpc_parse_run(i, init, final, &skipped);
+  if (x || !skipped) { return x; }
+  
+  mpc_err_delete(final->error);
+  i->state = start;
+  return mpc_parse_run(i, init, final, &skipped);
+}
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_n(filename, string, strlen(string), p, r);
+}
+
+int mpc_parse_n(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
   x = mpc_parse_input(i, p, r);
   mpc_input_delete(i);
   return x;
@@ -1143,6 +1630,7 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
+  mpc_input_t *i;
   int res;
   
   if (f == NULL) {
@@ -1151,7 +1639,14 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
+  i = mpc_input_new_mmap(filename, f);
+  if (i) {
+    res = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+  } else {
+    res = mpc_parse_file(filename, f, p, r);
+  }
+  
   fclose(f);
   return res;
 }
@@ -1265,26 +1760,298 @@ mpc_parser_t *mpc_new(const char *name) {
   return p;
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+static void mpc_undefine_retained(mpc_parser_t *p) {
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_undefine_retained(p);
+  mpc_analysis_stale(p);
   return p;
 }
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+/*
+** Work out which of the unretained parsers below p
+** are spans, see mpc_stack_span_begin. Retained
+** parsers never are, so the walk stops at them and
+** is done once for each definition.
+*/
+
+static int mpc_span_mark(mpc_parser_t *p);
+
+static int mpc_span_free(mpc_dtor_t d) {
+  return d == free || d == mpcf_dtor_null;
+}
+
+static void mpc_span_define(mpc_parser_t *p) {
+  
+  int i, s = 0;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+      s = 1;
+    break;
+    
+    case MPC_TYPE_LIFT: s = p->data.lift.lf == mpcf_ctor_str; break;
+    case MPC_TYPE_EXPECT: s = mpc_span_mark(p->data.expect.x); break;
+    case MPC_TYPE_PREDICT: s = mpc_span_mark(p->data.predict.x); break;
+    case MPC_TYPE_APPLY: mpc_span_mark(p->data.apply.x); break;
+    case MPC_TYPE_APPLY_TO: mpc_span_mark(p->data.apply_to.x); break;
+    case MPC_TYPE_NOT: mpc_span_mark(p->data.not.x); break;
+    
+    case MPC_TYPE_MAYBE:
+      s = mpc_span_mark(p->data.not.x) && p->data.not.lf == mpcf_ctor_str;
+    break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      s = mpc_span_mark(p->data.repeat.x) && p->data.repeat.f == mpcf_strfold;
+    break;
+    
+    case MPC_TYPE_COUNT:
+      s = mpc_span_mark(p->data.repeat.x) && p->data.repeat.f == mpcf_strfold
+        && mpc_span_free(p->data.repeat.dx);
+    break;
+    
+    case MPC_TYPE_OR:
+      s = p->data.or.n > 0;
+      for (i = 0; i < p->data.or.n; i++) {
+        if (!mpc_span_mark(p->data.or.xs[i])) { s = 0; }
+      }
+    break;
+    
+    case MPC_TYPE_AND:
+      s = p->data.and.n > 0 && p->data.and.f == mpcf_strfold;
+      for (i = 0; i < p->data.and.n; i++) {
+        if (!mpc_span_mark(p->data.and.xs[i])) { s = 0; }
+      }
+      for (i = 0; i < p->data.and.n-1; i++) {
+        if (!mpc_span_free(p->data.and.dxs[i])) { s = 0; }
+      }
+    break;
+    
+    default: break;
+  }
+  
+  p->span = p->retained ? 0 : s;
+}
+
+static int mpc_span_mark(mpc_parser_t *p) {
+  if (p->retained) { return 0; }
+  mpc_span_define(p);
+  return p->span;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+  
+  if (p->retained) {
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
+  }
+  
+  free(a);
+  mpc_span_define(p);
+  mpc_analysis_stale(p);
+  return p;  
+}
+
+/*
+** Memoize the results of the retained parser p
+** when parsing strings, see mpc_stack_memo_begin.
+** `copy` duplicates one of its outputs and `dx`
+** deletes one. Passing a NULL `copy` turns it off.
+*/
+
+mpc_parser_t *mpc_memoize(mpc_parser_t *p, mpc_apply_t copy, mpc_dtor_t dx) {
+  if (!p->retained) { return p; }
+  p->memo_copy = copy;
+  p->memo_dx = dx;
+  return p;
+}
+
+/*
+** Grammar Analysis
+**
+** For every parser reachable from p this works out
+** the characters it can start with, its first set,
+** and whether it can match without consuming one,
+** which is what `nullable` means here. With these
+** an `or` can skip the alternatives that are sure
+** to fail on the next character.
+**
+** Sets are grown from empty until nothing changes,
+** which handles the cycles of recursive grammars.
+** Parsers defined or redefined afterwards count as
+** able to match anything until analysed again.
+*/
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_parser_t **ps;
+} mpc_analysis_t;
+
+static void mpc_analyse_collect(mpc_analysis_t *a, mpc_parser_t *p) {
+  
+  int i;
+  
+  if (p->analysed == 2) { return; }
+  p->analysed = 2;
+  
+  a->num++;
+  if (a->num > a->slots) {
+    a->slots = a->slots ? a->slots * 2 : 64;
+    a->ps = realloc(a->ps, sizeof(mpc_parser_t*) * a->slots);
+  }
+  a->ps[a->num-1] = p;
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   mpc_analyse_collect(a, p->data.expect.x); break;
+    case MPC_TYPE_APPLY:    mpc_analyse_collect(a, p->data.apply.x); break;
+    case MPC_TYPE_APPLY_TO: mpc_analyse_collect(a, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_analyse_collect(a, p->data.predict.x); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    mpc_analyse_collect(a, p->data.not.x); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    mpc_analyse_collect(a, p->data.repeat.x); break;
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_analyse_collect(a, p->data.or.xs[i]); }
+    break;
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_analyse_collect(a, p->data.and.xs[i]); }
+    break;
+    default: break;
+  }
+}
+
+static void mpc_first_union(unsigned char *f, mpc_parser_t *x) {
+  int i;
+  for (i = 0; i < 32; i++) { f[i] |= x->first[i]; }
+}
+
+static void mpc_first_add(unsigned char *f, int c) {
+  f[c >> 3] |= 1 << (c & 7);
+}
+
+/* One step of the analysis, returns if p changed */
+static int mpc_analyse_step(mpc_parser_t *p) {
+  
+  int i, c, n = 0;
+  unsigned char f[32];
+  
+  memset(f, 0, sizeof(f));
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: break;
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_SATISFY:
+      memset(f, 0xFF, sizeof(f));
+      n = p->type == MPC_TYPE_UNDEFINED;
+    break;
+    
+    case MPC_TYPE_ANY: memset(f, 0xFF, sizeof(f)); break;
+    case MPC_TYPE_SINGLE: mpc_first_add(f, (unsigned char)p->data.single.x); break;
+    
+    case MPC_TYPE_RANGE:
+      for (c = 0; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { mpc_first_add(f, c); }
+      }
+    break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (c = 0; c < 256; c++) {
+        if ((c != 0 && strchr(p->data.string.x, (char)c) != 0) == (p->type == MPC_TYPE_ONEOF)) { mpc_first_add(f, c); }
+      }
+    break;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { mpc_first_add(f, (unsigned char)p->data.string.x[0]); } else { n = 1; }
+    break;
+    
+    case MPC_TYPE_EXPECT:   mpc_first_union(f, p->data.expect.x); n = p->data.expect.x->nullable; break;
+    case MPC_TYPE_APPLY:    mpc_first_union(f, p->data.apply.x); n = p->data.apply.x->nullable; break;
+    case MPC_TYPE_APPLY_TO: mpc_first_union(f, p->data.apply_to.x); n = p->data.apply_to.x->nullable; break;
+    case MPC_TYPE_PREDICT:  mpc_first_union(f, p->data.predict.x); n = p->data.predict.x->nullable; break;
+    
+    case MPC_TYPE_NOT: n = 1; break;
+    case MPC_TYPE_MAYBE: mpc_first_union(f, p->data.not.x); n = 1; break;
+    case MPC_TYPE_MANY: mpc_first_union(f, p->data.repeat.x); n = 1; break;
+    
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_first_union(f, p->data.repeat.x);
+      n = p->data.repeat.x->nullable || (p->type == MPC_TYPE_COUNT && p->data.repeat.n == 0);
+    break;
+    
+    case MPC_TYPE_OR:
+      n = p->data.or.n == 0;
+      for (i = 0; i < p->data.or.n; i++) {
+        mpc_first_union(f, p->data.or.xs[i]);
+        n = n || p->data.or.xs[i]->nullable;
+      }
+    break;
+    
+    case MPC_TYPE_AND:
+      n = 1;
+      for (i = 0; i < p->data.and.n && n; i++) {
+        mpc_first_union(f, p->data.and.xs[i]);
+        n = p->data.and.xs[i]->nullable;
+      }
+    break;
+    
+    /* Pass, lift, start and end of input */
+    default: n = 1; break;
+  }
+  
+  if (n == p->nullable && memcmp(f, p->first, sizeof(f)) == 0) { return 0; }
+  
+  p->nullable = p->nullable || n;
+  for (i = 0; i < 32; i++) { p->first[i] |= f[i]; }
+  return 1;
+}
+
+void mpc_analyse(mpc_parser_t *p) {
   
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
+  int i, changed = 1;
+  mpc_analysis_t a;
+  
+  a.num = 0;
+  a.slots = 0;
+  a.ps = NULL;
+  mpc_analyse_collect(&a, p);
+  
+  for (i = 0; i < a.num; i++) {
+    a.ps[i]->nullable = 0;
+    memset(a.ps[i]->first, 0, sizeof(a.ps[i]->first));
   }
   
-  free(a);
-  return p;  
+  while (changed) {
+    changed = 0;
+    for (i = 0; i < a.num; i++) { changed |= mpc_analyse_step(a.ps[i]); }
+  }
+  
+  for (i = 0; i < a.num; i++) {
+    a.ps[i]->analysed = 1;
+    a.ps[i]->generation = MPC_GENERATION_GET();
+  }
+  free(a.ps);
 }
 
 void mpc_cleanup(int n, ...) {
@@ -1294,7 +2061,7 @@ void mpc_cleanup(int n, ...) {
   va_list va;
   va_start(va, n);
   for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_undefine_retained(list[i]); }
   for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
   va_end(va);  
 
@@ -1620,7 +2387,7 @@ mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline");
 mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
 mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
 
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("012345689"), "digit"); }
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
 mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
 mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
 mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
@@ -1984,6 +2751,125 @@ mpc_parser_t *mpc_re(const char *re) {
   
 }
 
+/*
+** Number Parsing
+**
+** Most numbers in source text are short decimals
+** which `strtod` converts slowly. When the digits
+** fit in 53 bits and the power of ten is exact as
+** a double, the value is one correctly rounded
+** multiplication or division away. Anything else
+** is left to `strtod`.
+*/
+
+static const double mpc_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+  1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+  1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int mpc_digit_run(const char *s) {
+  int n = 0;
+  while (s[n] >= '0' && s[n] <= '9') { n++; }
+  return n;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+/* Eight digits at once, combining pairs then quads in one word */
+static unsigned long long mpc_digits8(const char *s) {
+  unsigned long long v;
+  memcpy(&v, s, 8);
+  v -= 0x3030303030303030ULL;
+  v = (v * 10) + (v >> 8);
+  return (((v & 0x000000FF000000FFULL) * 0x000F424000000064ULL)
+    + (((v >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+}
+
+#else
+
+static unsigned long long mpc_digits8(const char *s) {
+  int i;
+  unsigned long long v = 0;
+  for (i = 0; i < 8; i++) { v = v * 10 + (s[i] - '0'); }
+  return v;
+}
+
+#endif
+
+static unsigned long long mpc_digits_value(unsigned long long w, const char *s, int n) {
+  while (n >= 8) { w = w * 100000000ULL + mpc_digits8(s); s += 8; n -= 8; }
+  while (n > 0) { w = w * 10 + (*s - '0'); s++; n--; }
+  return w;
+}
+
+double mpc_strtod(const char *s, char **end) {
+  
+  const char *p = s, *q, *frac;
+  unsigned long long w = 0;
+  int neg = 0, n = 0, k, e = 0, x = 0, xneg = 0, digits;
+  double d;
+  
+  if (FLT_EVAL_METHOD != 0) { return strtod(s, end); }
+  
+  if (*p == '-' || *p == '+') { neg = *p == '-'; p++; }
+  if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) { return strtod(s, end); }
+  
+  /* significant digits, leading zeros don't count */
+  digits = mpc_digit_run(p);
+  while (*p == '0') { p++; digits--; }
+  if (digits > 19) { return strtod(s, end); }
+  w = mpc_digits_value(w, p, digits);
+  n = digits;
+  p += digits;
+  digits = (int)(p - s) > (neg || *s == '+');
+  
+  if (*p == '.') {
+    frac = ++p;
+    if (n == 0) { while (*p == '0') { p++; } }
+    k = mpc_digit_run(p);
+    if (n + k > 19) { return strtod(s, end); }
+    w = mpc_digits_value(w, p, k);
+    n += k;
+    p += k;
+    e = -(int)(p - frac);
+    digits = digits || p > frac;
+  }
+  
+  if (!digits) { return strtod(s, end); }
+  
+  if (*p == 'e' || *p == 'E') {
+    q = p + 1;
+    if (*q == '-' || *q == '+') { xneg = *q == '-'; q++; }
+    if (*q >= '0' && *q <= '9') {
+      while (*q >= '0' && *q <= '9') { if (x < 100000) { x = x * 10 + (*q - '0'); } q++; }
+      e += xneg ? -x : x;
+      p = q;
+    }
+  }
+  
+  if (w > (1ULL << 53)) { return strtod(s, end); }
+  
+  d = (double)w;
+  if (w == 0) {
+    d = 0.0;
+  } else if (e < 0) {
+    if (e < -22) { return strtod(s, end); }
+    d /= mpc_pow10[-e];
+  } else if (e > 22) {
+    /* some of the power can go into the digits if they stay exact */
+    if (e > 22 + 15) { return strtod(s, end); }
+    d *= mpc_pow10[e - 22];
+    if (d > 9007199254740992.0) { return strtod(s, end); }
+    d *= 1e22;
+  } else {
+    d *= mpc_pow10[e];
+  }
+  
+  if (end) { *end = (char*)p; }
+  return neg ? -d : d;
+}
+
 /*
 ** Common Fold Functions
 */
@@ -2017,7 +2903,7 @@ mpc_val_t *mpcf_oct(mpc_val_t *x) {
 
 mpc_val_t *mpcf_float(mpc_val_t *x) {
   float* y = malloc(sizeof(float));
-  *y = strtod(x, NULL);
+  *y = mpc_strtod(x, NULL);
   free(x);
   return y;
 }
@@ -2175,13 +3061,23 @@ mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1)
 mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  char *x = calloc(1, 1);
+  
+  char *x;
   int i;
+  size_t l = 0, m;
+  
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  
+  x = malloc(l + 1);
+  l = 0;
   for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
-    strcat(x, xs[i]);
+    m = strlen(xs[i]);
+    memcpy(x + l, xs[i], m);
+    l += m;
     free(xs[i]);
   }
+  x[l] = '\0';
+  
   return x;
 }
 
@@ -2485,6 +3381,23 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   return a;
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *r;
+  
+  if (a == NULL) { return a; }
+  
+  r = mpc_ast_new(a->tag, a->contents);
+  r->children_num = a->children_num;
+  r->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (i = 0; i < a->children_num; i++) {
+    r->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  
+  return r;
+}
+
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
@@ -2924,14 +3837,23 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+  mpc_parser_t *left, **lefts;
+  int i, n = 0;
+  
+  while (stmts[n]) { n++; }
+  lefts = malloc(sizeof(mpc_parser_t*) * (n+1));
+  n = 0;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
+    lefts[n++] = left;
     if (st->flags & MPC_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_define(left, stmt->grammar);
+    if (st->flags & MPC_LANG_PACKRAT) {
+      mpc_memoize(left, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete);
+    }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -2939,6 +3861,10 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   }
   free(x);
   
+  /* Every rule is defined now, so their first sets are known */
+  for (i = 0; i < n; i++) { mpc_analyse(lefts[i]); }
+  free(lefts);
+  
   return NULL;
 }
 
@@ -3063,7 +3989,7 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_string("<mpca_lang>", language);
+  i = mpc_input_new_string("<mpca_lang>", language, strlen(language));
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3093,7 +4019,8 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_file(filename, f);
+  i = mpc_input_new_mmap(filename, f);
+  if (!i) { i = mpc_input_new_file(filename, f); }
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -3104,3 +4031,492 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   
   return err;
 }
+
+/*
+** Parser Images
+**
+** A parser graph can be written out to a flat image
+** and rebuilt from it later without running the
+** grammar compiler or the regex compiler again.
+**
+** Parsers are numbered in the order they are first
+** reached, the given parsers first. References to
+** parsers are stored as these numbers and functions
+** as indices into a table of the functions mpc
+** itself provides, so the image holds no pointers.
+** Graphs using any other function, or lifting an
+** arbitrary value, can't be saved.
+**
+** Numbers are stored in the byte order of the host,
+** images are meant to be loaded on the same kind of
+** machine that saved them.
+*/
+
+typedef void (*mpc_image_fn_t)(void);
+
+static mpc_image_fn_t mpc_image_fns[] = {
+  (mpc_image_fn_t)free,
+  (mpc_image_fn_t)mpc_soft_delete,
+  (mpc_image_fn_t)mpcf_dtor_null,
+  (mpc_image_fn_t)mpcf_ctor_null,
+  (mpc_image_fn_t)mpcf_ctor_str,
+  (mpc_image_fn_t)mpcf_free,
+  (mpc_image_fn_t)mpcf_int,
+  (mpc_image_fn_t)mpcf_hex,
+  (mpc_image_fn_t)mpcf_oct,
+  (mpc_image_fn_t)mpcf_float,
+  (mpc_image_fn_t)mpcf_escape,
+  (mpc_image_fn_t)mpcf_unescape,
+  (mpc_image_fn_t)mpcf_unescape_regex,
+  (mpc_image_fn_t)mpcf_escape_string_raw,
+  (mpc_image_fn_t)mpcf_unescape_string_raw,
+  (mpc_image_fn_t)mpcf_escape_char_raw,
+  (mpc_image_fn_t)mpcf_unescape_char_raw,
+  (mpc_image_fn_t)mpcf_null,
+  (mpc_image_fn_t)mpcf_fst,
+  (mpc_image_fn_t)mpcf_snd,
+  (mpc_image_fn_t)mpcf_trd,
+  (mpc_image_fn_t)mpcf_fst_free,
+  (mpc_image_fn_t)mpcf_snd_free,
+  (mpc_image_fn_t)mpcf_trd_free,
+  (mpc_image_fn_t)mpcf_strfold,
+  (mpc_image_fn_t)mpcf_maths,
+  (mpc_image_fn_t)mpcf_fold_ast,
+  (mpc_image_fn_t)mpcf_str_ast,
+  (mpc_image_fn_t)mpc_ast_delete,
+  (mpc_image_fn_t)mpc_ast_add_root,
+  (mpc_image_fn_t)mpc_ast_tag,
+  (mpc_image_fn_t)mpc_ast_add_tag
+};
+
+#define MPC_IMAGE_FNS_NUM ((int)(sizeof(mpc_image_fns) / sizeof(mpc_image_fns[0])))
+#define MPC_IMAGE_NONE 0xFFFFFFFF
+#define MPC_IMAGE_MAGIC 0x4d504349
+#define MPC_IMAGE_VERSION 1
+
+/*
+** Tags are not owned by the parsers that set them,
+** so on loading they are pointed at the name of one
+** of the given parsers, or at one of the tags the
+** grammar compiler uses.
+*/
+
+static const char *mpc_image_tags[] = { "string", "char", "regex" };
+
+static const char *mpc_image_find_tag(mpc_parser_t **roots, int n, const char *s, size_t len) {
+  int i;
+  for (i = 0; i < (int)(sizeof(mpc_image_tags) / sizeof(mpc_image_tags[0])); i++) {
+    if (strlen(mpc_image_tags[i]) == len && memcmp(mpc_image_tags[i], s, len) == 0) { return mpc_image_tags[i]; }
+  }
+  for (i = 0; i < n; i++) {
+    if (roots[i]->name && strlen(roots[i]->name) == len && memcmp(roots[i]->name, s, len) == 0) { return roots[i]->name; }
+  }
+  return NULL;
+}
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  mpc_parser_t **parsers;
+  int parsers_num;
+  int roots_num;
+  int failed;
+} mpc_image_out_t;
+
+static void mpc_image_write(mpc_image_out_t *o, const void *x, size_t n) {
+  while (o->len + n > o->cap) {
+    o->cap = o->cap ? o->cap * 2 : 4096;
+    o->data = realloc(o->data, o->cap);
+  }
+  memcpy(o->data + o->len, x, n);
+  o->len += n;
+}
+
+static void mpc_image_u32(mpc_image_out_t *o, unsigned int x) {
+  unsigned int y = x;
+  mpc_image_write(o, &y, sizeof(y));
+}
+
+static void mpc_image_u8(mpc_image_out_t *o, char x) {
+  mpc_image_write(o, &x, 1);
+}
+
+static void mpc_image_str(mpc_image_out_t *o, const char *s) {
+  if (s == NULL) { mpc_image_u32(o, MPC_IMAGE_NONE); return; }
+  mpc_image_u32(o, strlen(s));
+  mpc_image_write(o, s, strlen(s));
+}
+
+static void mpc_image_fn(mpc_image_out_t *o, mpc_image_fn_t f) {
+  int i;
+  if (f == NULL) { mpc_image_u32(o, MPC_IMAGE_NONE); return; }
+  for (i = 0; i < MPC_IMAGE_FNS_NUM; i++) {
+    if (mpc_image_fns[i] == f) { mpc_image_u32(o, i); return; }
+  }
+  o->failed = 1;
+}
+
+static int mpc_image_number(mpc_image_out_t *o, mpc_parser_t *p) {
+  int i;
+  for (i = 0; i < o->parsers_num; i++) {
+    if (o->parsers[i] == p) { return i; }
+  }
+  o->parsers_num++;
+  o->parsers = realloc(o->parsers, sizeof(mpc_parser_t*) * o->parsers_num);
+  o->parsers[o->parsers_num-1] = p;
+  return o->parsers_num-1;
+}
+
+static void mpc_image_ref(mpc_image_out_t *o, mpc_parser_t *p) {
+  mpc_image_u32(o, mpc_image_number(o, p));
+}
+
+static void mpc_image_parser(mpc_image_out_t *o, mpc_parser_t *p) {
+  
+  int i;
+  mpc_pdata_t *d = &p->data;
+  
+  mpc_image_u8(o, p->type);
+  mpc_image_u8(o, p->retained);
+  mpc_image_str(o, p->name);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: mpc_image_str(o, d->fail.m); break;
+    case MPC_TYPE_LIFT: mpc_image_fn(o, (mpc_image_fn_t)d->lift.lf); break;
+    case MPC_TYPE_LIFT_VAL: if (d->lift.x != NULL) { o->failed = 1; } break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_image_ref(o, d->expect.x);
+      mpc_image_str(o, d->expect.m);
+      break;
+    
+    case MPC_TYPE_SINGLE: mpc_image_u8(o, d->single.x); break;
+    case MPC_TYPE_RANGE:
+      mpc_image_u8(o, d->range.x);
+      mpc_image_u8(o, d->range.y);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      mpc_image_str(o, d->string.x);
+      break;
+    
+    case MPC_TYPE_SATISFY: mpc_image_fn(o, (mpc_image_fn_t)d->satisfy.f); break;
+    
+    case MPC_TYPE_APPLY:
+      mpc_image_ref(o, d->apply.x);
+      mpc_image_fn(o, (mpc_image_fn_t)d->apply.f);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      if (d->apply_to.f != (mpc_apply_to_t)mpc_ast_tag
+      &&  d->apply_to.f != (mpc_apply_to_t)mpc_ast_add_tag) { o->failed = 1; break; }
+      if (!mpc_image_find_tag(o->parsers, o->roots_num, d->apply_to.d, strlen(d->apply_to.d))) { o->failed = 1; break; }
+      mpc_image_ref(o, d->apply_to.x);
+      mpc_image_fn(o, (mpc_image_fn_t)d->apply_to.f);
+      mpc_image_str(o, d->apply_to.d);
+      break;
+    
+    case MPC_TYPE_PREDICT: mpc_image_ref(o, d->predict.x); break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_image_ref(o, d->not.x);
+      mpc_image_fn(o, (mpc_image_fn_t)d->not.dx);
+      mpc_image_fn(o, (mpc_image_fn_t)d->not.lf);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_image_u32(o, d->repeat.n);
+      mpc_image_fn(o, (mpc_image_fn_t)d->repeat.f);
+      mpc_image_ref(o, d->repeat.x);
+      mpc_image_fn(o, (mpc_image_fn_t)d->repeat.dx);
+      break;
+    
+    case MPC_TYPE_OR:
+      mpc_image_u32(o, d->or.n);
+      for (i = 0; i < d->or.n; i++) { mpc_image_ref(o, d->or.xs[i]); }
+      break;
+    
+    case MPC_TYPE_AND:
+      mpc_image_u32(o, d->and.n);
+      mpc_image_fn(o, (mpc_image_fn_t)d->and.f);
+      for (i = 0; i < d->and.n; i++) { mpc_image_ref(o, d->and.xs[i]); }
+      for (i = 0; i < d->and.n-1; i++) { mpc_image_fn(o, (mpc_image_fn_t)d->and.dxs[i]); }
+      break;
+    
+    default: break;
+  }
+  
+}
+
+char *mpc_image_save(size_t *size, int n, ...) {
+  
+  int i;
+  size_t count_at;
+  va_list va;
+  mpc_image_out_t o;
+  
+  o.data = NULL;
+  o.len = 0;
+  o.cap = 0;
+  o.parsers = NULL;
+  o.parsers_num = 0;
+  o.roots_num = 0;
+  o.failed = 0;
+  
+  mpc_image_u32(&o, MPC_IMAGE_MAGIC);
+  mpc_image_u32(&o, MPC_IMAGE_VERSION);
+  mpc_image_u32(&o, n);
+  count_at = o.len;
+  mpc_image_u32(&o, 0);
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) { mpc_image_number(&o, va_arg(va, mpc_parser_t*)); }
+  va_end(va);
+  o.roots_num = o.parsers_num;
+  
+  /* Writing a parser numbers the ones it refers to */
+  for (i = 0; i < o.parsers_num && !o.failed; i++) {
+    mpc_image_parser(&o, o.parsers[i]);
+  }
+  
+  memcpy(o.data + count_at, &o.parsers_num, sizeof(unsigned int));
+  free(o.parsers);
+  
+  if (o.failed) { free(o.data); return NULL; }
+  
+  *size = o.len;
+  return o.data;
+}
+
+/*
+** Loading reads the image twice: the first pass
+** only checks it, so that the second pass which
+** builds the parsers can't fail half way.
+*/
+
+typedef struct {
+  const char *data;
+  size_t len;
+  size_t pos;
+  mpc_parser_t **parsers;
+  int parsers_num;
+  int roots_num;
+  int build;
+  int failed;
+} mpc_image_in_t;
+
+static unsigned int mpc_image_read_u32(mpc_image_in_t *in) {
+  unsigned int x = 0;
+  if (in->pos + sizeof(x) > in->len) { in->failed = 1; return 0; }
+  memcpy(&x, in->data + in->pos, sizeof(x));
+  in->pos += sizeof(x);
+  return x;
+}
+
+static char mpc_image_read_u8(mpc_image_in_t *in) {
+  if (in->pos + 1 > in->len) { in->failed = 1; return 0; }
+  return in->data[in->pos++];
+}
+
+/* Returns a new string, or the position of the string when only checking */
+static char *mpc_image_read_str(mpc_image_in_t *in) {
+  char *s;
+  unsigned int n = mpc_image_read_u32(in);
+  if (in->failed || n == MPC_IMAGE_NONE) { return NULL; }
+  if (in->pos + n > in->len) { in->failed = 1; return NULL; }
+  s = (char*)in->data + in->pos;
+  in->pos += n;
+  if (!in->build) { return s; }
+  s = memcpy(malloc(n + 1), s, n);
+  s[n] = '\0';
+  return s;
+}
+
+static mpc_image_fn_t mpc_image_read_fn(mpc_image_in_t *in) {
+  unsigned int i = mpc_image_read_u32(in);
+  if (in->failed || i == MPC_IMAGE_NONE) { return NULL; }
+  if (i >= (unsigned int)MPC_IMAGE_FNS_NUM) { in->failed = 1; return NULL; }
+  return mpc_image_fns[i];
+}
+
+static mpc_parser_t *mpc_image_read_ref(mpc_image_in_t *in) {
+  unsigned int i = mpc_image_read_u32(in);
+  if (in->failed) { return NULL; }
+  if (i >= (unsigned int)in->parsers_num) { in->failed = 1; return NULL; }
+  return in->build ? in->parsers[i] : NULL;
+}
+
+static const char *mpc_image_read_tag(mpc_image_in_t *in) {
+  
+  const char *tag;
+  unsigned int n = mpc_image_read_u32(in);
+  
+  if (in->failed || n == MPC_IMAGE_NONE || in->pos + n > in->len) { in->failed = 1; return NULL; }
+  tag = mpc_image_find_tag(in->parsers, in->roots_num, in->data + in->pos, n);
+  in->pos += n;
+  
+  if (tag == NULL) { in->failed = 1; }
+  return tag;
+}
+
+static void mpc_image_read_parser(mpc_image_in_t *in, int index) {
+  
+  int i, n;
+  char type = mpc_image_read_u8(in);
+  char retained = mpc_image_read_u8(in);
+  char *name = mpc_image_read_str(in);
+  mpc_parser_t *p = in->build ? in->parsers[index] : NULL;
+  mpc_pdata_t dummy;
+  mpc_pdata_t *d = p ? &p->data : &dummy;
+  
+  /* The given parsers keep their own names */
+  if (p && index >= in->roots_num) {
+    p->type = type;
+    p->retained = retained;
+    p->name = name;
+  } else if (p) {
+    p->type = type;
+    free(name);
+  }
+  
+  switch (type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_LIFT_VAL:
+      break;
+    
+    case MPC_TYPE_FAIL: d->fail.m = mpc_image_read_str(in); break;
+    case MPC_TYPE_LIFT: d->lift.lf = (mpc_ctor_t)mpc_image_read_fn(in); break;
+    
+    case MPC_TYPE_EXPECT:
+      d->expect.x = mpc_image_read_ref(in);
+      d->expect.m = mpc_image_read_str(in);
+      break;
+    
+    case MPC_TYPE_SINGLE: d->single.x = mpc_image_read_u8(in); break;
+    case MPC_TYPE_RANGE:
+      d->range.x = mpc_image_read_u8(in);
+      d->range.y = mpc_image_read_u8(in);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      d->string.x = mpc_image_read_str(in);
+      break;
+    
+    case MPC_TYPE_SATISFY: d->satisfy.f = (int(*)(char))mpc_image_read_fn(in); break;
+    
+    case MPC_TYPE_APPLY:
+      d->apply.x = mpc_image_read_ref(in);
+      d->apply.f = (mpc_apply_t)mpc_image_read_fn(in);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      d->apply_to.x = mpc_image_read_ref(in);
+      d->apply_to.f = (mpc_apply_to_t)mpc_image_read_fn(in);
+      d->apply_to.d = (void*)mpc_image_read_tag(in);
+      break;
+    
+    case MPC_TYPE_PREDICT: d->predict.x = mpc_image_read_ref(in); break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      d->not.x = mpc_image_read_ref(in);
+      d->not.dx = (mpc_dtor_t)mpc_image_read_fn(in);
+      d->not.lf = (mpc_ctor_t)mpc_image_read_fn(in);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      d->repeat.n = mpc_image_read_u32(in);
+      d->repeat.f = (mpc_fold_t)mpc_image_read_fn(in);
+      d->repeat.x = mpc_image_read_ref(in);
+      d->repeat.dx = (mpc_dtor_t)mpc_image_read_fn(in);
+      break;
+    
+    case MPC_TYPE_OR:
+      n = mpc_image_read_u32(in);
+      if (n < 0 || (size_t)n > in->len) { in->failed = 1; break; }
+      d->or.n = n;
+      d->or.xs = p ? malloc(sizeof(mpc_parser_t*) * n) : NULL;
+      for (i = 0; i < n; i++) {
+        mpc_parser_t *x = mpc_image_read_ref(in);
+        if (p) { d->or.xs[i] = x; }
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      n = mpc_image_read_u32(in);
+      if (n < 1 || (size_t)n > in->len) { in->failed = 1; break; }
+      d->and.n = n;
+      d->and.f = (mpc_fold_t)mpc_image_read_fn(in);
+      d->and.xs = p ? malloc(sizeof(mpc_parser_t*) * n) : NULL;
+      d->and.dxs = p ? malloc(sizeof(mpc_dtor_t) * (n-1)) : NULL;
+      for (i = 0; i < n; i++) {
+        mpc_parser_t *x = mpc_image_read_ref(in);
+        if (p) { d->and.xs[i] = x; }
+      }
+      for (i = 0; i < n-1; i++) {
+        mpc_dtor_t dx = (mpc_dtor_t)mpc_image_read_fn(in);
+        if (p) { d->and.dxs[i] = dx; }
+      }
+      break;
+    
+    default: in->failed = 1; break;
+  }
+  
+}
+
+int mpc_image_load(const char *image, size_t size, int n, ...) {
+  
+  int i;
+  va_list va;
+  mpc_image_in_t in;
+  
+  in.data = image;
+  in.len = size;
+  in.pos = 0;
+  in.roots_num = n;
+  in.build = 0;
+  in.failed = 0;
+  
+  if (mpc_image_read_u32(&in) != MPC_IMAGE_MAGIC
+  ||  mpc_image_read_u32(&in) != MPC_IMAGE_VERSION
+  ||  mpc_image_read_u32(&in) != (unsigned int)n) { return 0; }
+  
+  in.parsers_num = mpc_image_read_u32(&in);
+  if (in.failed || in.parsers_num < n || (size_t)in.parsers_num > size) { return 0; }
+  
+  in.parsers = malloc(sizeof(mpc_parser_t*) * in.parsers_num);
+  va_start(va, n);
+  for (i = 0; i < n; i++) { in.parsers[i] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+  
+  for (i = 0; i < in.parsers_num && !in.failed; i++) { mpc_image_read_parser(&in, i); }
+  if (in.failed) { free(in.parsers); return 0; }
+  
+  /* The image is fine, build the parsers for real */
+  for (i = n; i < in.parsers_num; i++) { in.parsers[i] = mpc_undefined(); }
+  
+  in.pos = 4 * sizeof(unsigned int);
+  in.build = 1;
+  for (i = 0; i < in.parsers_num; i++) { mpc_image_read_parser(&in, i); }
+  for (i = 0; i < in.parsers_num && !in.failed; i++) { mpc_span_define(in.parsers[i]); }
+  for (i = 0; i < n && !in.failed; i++) { mpc_analyse(in.parsers[i]); }
+  
+  free(in.parsers);
+  return !in.failed;
+}
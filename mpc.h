@@ -56,6 +56,7 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_n(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
@@ -78,6 +79,8 @@ typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 mpc_parser_t *mpc_new(const char *name);
 mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a);
 mpc_parser_t *mpc_undefine(mpc_parser_t *p);
+mpc_parser_t *mpc_memoize(mpc_parser_t *p, mpc_apply_t copy, mpc_dtor_t dx);
+void mpc_analyse(mpc_parser_t *p);
 
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
@@ -229,6 +232,12 @@ mpc_val_t *mpcf_trd_free(int n, mpc_val_t** xs);
 mpc_val_t *mpcf_strfold(int n, mpc_val_t** xs);
 mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
 
+/*
+** Number Parsing
+*/
+
+double mpc_strtod(const char *s, char **end);
+
 /*
 ** Regular Expression Parsers
 */
@@ -252,6 +261,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -279,7 +289,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPC_LANG_DEFAULT              = 0,
   MPC_LANG_PREDICTIVE           = 1,
-  MPC_LANG_WHITESPACE_SENSITIVE = 2
+  MPC_LANG_WHITESPACE_SENSITIVE = 2,
+  MPC_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -289,6 +300,13 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Parser Images
+*/
+
+char *mpc_image_save(size_t *size, int n, ...);
+int mpc_image_load(const char *image, size_t size, int n, ...);
+
 /*
 ** Debug & Testing
 */
@@ -1,6 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <editline/readline.h>
 
@@ -9,506 +30,900 @@
 #include <editline/history.h>
 #endif
 
-#include "mpc.h"
+#include "task.h"
+#include "minilisp_internal.h"
+#include "lshm.h"
+
+void start_repl(lenv *e) {
+  printf("Minilisp Version 0.0.1\n");
+  printf("Press Ctrl+c to Exit\n\n");
+
+  lbuf out;
+  lbuf_init(&out, stdout);
+
+  // REPL loop
+  while (1) {
+    // prompt and read the input
+    char* input = readline("minilisp> ");
+
+    // break if EOF
+    if (! input)
+      break;
+
+    // add input to history
+    add_history(input);
+
+    // attempt to parse the user input
+    eval_print(e, &out, "<stdin>", input, 0, 0);
+    lbuf_flush(&out);
+    fflush(stdout);
 
-mpc_parser_t *Number, *Symbol, *Sexpr, *Qexpr, *Expr, *Program;
-void define_grammar() {
-  Number = mpc_new("number");
-  Symbol = mpc_new("symbol");
-  Sexpr = mpc_new("sexpr");
-  Qexpr = mpc_new("qexpr");
-  Expr = mpc_new("expr");
-  Program = mpc_new("program");
+    // free retrived input
+    free(input);
+  }
 
-  // define the grammar for this language
-  mpca_lang(MPC_LANG_DEFAULT,
-      " \
-        number: /-?[0-9]+(\\.[0-9]+)?/ ; \
-        symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-        sexpr: '(' <expr>* ')' ; \
-        qexpr: '{' <expr>* '}' ; \
-        expr: <number> | <symbol> | <sexpr> | <qexpr> ; \
-        program: /^/ <expr>* /$/ ; \
-      ", Number, Symbol, Sexpr, Qexpr, Expr, Program);
+  lbuf_free(&out);
+}
+
+// Command line settings that every interpreter context gets.
+typedef struct {
+  char *image;
+  int parallel;
+  // print limits, all -1 to keep those of the image
+  long max_depth, max_elements, max_bytes;
+} lopts;
+
+// a context as configured, NULL if the image can't be loaded
+lenv *lopts_context(lopts *o) {
+  lenv *e = o->image ? minilisp_load_image(o->image) : minilisp_new();
+  if (! e)
+    return NULL;
+  if (o->parallel)
+    minilisp_set_parallel(e, o->parallel);
+  if (o->max_depth >= 0)
+    minilisp_set_print_limits(e, o->max_depth, o->max_elements, o->max_bytes);
+  return e;
+}
+
+// A context is used by one thread at a time, so the pool workers that run
+// batch shards and socket requests each get their own, created with their
+// first job; workers run until the process exits, so these are never freed.
+_Thread_local lenv *lworker_env;
+
+lenv *lworker_context(lopts *o) {
+  if (! lworker_env)
+    lworker_env = lopts_context(o);
+  return lworker_env;
+}
+
+// Batch mode reads one top-level expression at a time from a stream, so
+// inputs of any size are evaluated without loading them whole.
+typedef struct {
+  FILE *f;
+  lbuf expr;      // text of the current expression
+  int row, col;   // position of the next character
+  int expr_row, expr_col;
+} lreader;
+
+int lreader_getc(lreader *r) {
+  int c = getc(r->f);
+  if (c == '\n') {
+    r->row++;
+    r->col = 0;
+  } else if (c != EOF) {
+    r->col++;
+  }
+  return c;
 }
 
-void clean_grammar() {
-  // undefine and delete the parsers
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Program);
+// Read the next top-level expression into r->expr, 0 at the end of input.
+// A line that starts with an atom is read to its end as one expression,
+// like the REPL reads every line, so "+ 1 2" is the call (+ 1 2) rather
+// than three atoms; brackets still open at the end of the line carry it
+// on to the next ones. An expression in brackets ends with its closing
+// bracket, so a form can span lines and several can share one.
+int lreader_next(lreader *r) {
+  int c;
+  do {
+    r->expr_row = r->row;
+    r->expr_col = r->col;
+    c = lreader_getc(r);
+  } while (c != EOF && isspace(c));
+
+  if (c == EOF)
+    return 0;
+
+  r->expr.len = 0;
+  int line = c != '(' && c != '{' && c != ')' && c != '}';
+  int depth = 0;
+  while (c != EOF) {
+    if (line && depth <= 0 && c == '\n')
+      break;
+    lbuf_putc(&r->expr, c);
+
+    if (c == '(' || c == '{') {
+      depth++;
+    } else if (c == ')' || c == '}') {
+      // an unbalanced closing bracket is left for the parser to report
+      if (--depth <= 0 && ! line)
+        break;
+    }
+
+    c = lreader_getc(r);
+  }
+
+  return 1;
 }
 
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
+// evaluate every expression in f, returns the number of expressions and
+// adds the number of errors to *errors
+long eval_batch(lenv *e, lbuf *out, char *filename, FILE *f, long *errors) {
+  lreader r = { f };
+  lbuf_init(&r.expr, NULL);
 
-typedef lval* (*lbuiltin)(lenv*, lval*);
+  long count = 0, before = minilisp_errors(e);
+  while (lreader_next(&r)) {
+    eval_print(e, out, filename, r.expr.data, r.expr_row, r.expr_col);
+    count++;
+  }
+  *errors += minilisp_errors(e) - before;
 
-struct lval {
-  int type;
-  double num;
+  lbuf_free(&r.expr);
+  return count;
+}
 
-  // Error and symbol are represented by strings
-  char *err;
-  char *sym;
-  // Function is represented by a function pointer
-  lbuiltin fun;
+// With more than one worker the batch is cut into shards of expressions
+// that the pool evaluates in parallel, each into an output buffer of its
+// own, and each worker evaluates in its own context.
+// At most LSHARD_WINDOW shards per worker are in flight and the oldest one
+// is always written out first, so the output keeps the input order.
+#define LSHARD_EXPRS 256
+#define LSHARD_WINDOW 4
 
-  // A list of lval and the number of elements in the list
+typedef struct {
+  lopts *opts;
+  char *filename;
+  lbuf text;   // the expressions, each terminated by a NUL
   int count;
-  struct lval** cell;
-};
-
-// possible types of lval
-enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
-
-// number factory
-lval *lval_num(double x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->count = 0;
-  v->num = x;
-  return v;
-}
-
-// error factory
-lval *lval_err(char *m) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
-  v->count = 0;
-  v->err = malloc(strlen(m) + 1);
-  strcpy(v->err, m);
-  return v;
-}
-
-// symbol factory
-lval *lval_sym(char *s) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->count = 0;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-  return v;
-}
-
-// function factory
-lval *lval_fun(lbuiltin f) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->count = 0;
-  v->fun = f;
-  return v;
-}
-
-// s-expr factory
-lval *lval_sexpr() {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
-}
-
-// q-expr factory
-lval *lval_qexpr() {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
-}
-
-void lval_del(lval *v) {
-  switch (v->type) {
-    case LVAL_NUM: break;
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_FUN: break;
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-      for (int i = 0; i < v->count; i++)
-        lval_del(v->cell[i]);
-
-      free(v->cell);
+  int rows[LSHARD_EXPRS];
+  int cols[LSHARD_EXPRS];
+  lbuf out;
+  long errors;
+  task *t;
+} lshard;
+
+void lshard_run(void *arg) {
+  lshard *s = arg;
+  lenv *e = lworker_context(s->opts);
+  if (! e) {
+    lbuf_puts(&s->out, "Error: Unable to create an interpreter context.\n");
+    s->errors = s->count;
+    return;
+  }
+
+  long before = minilisp_errors(e);
+  char *expr = s->text.data;
+  for (int i = 0; i < s->count; i++) {
+    eval_print(e, &s->out, s->filename, expr, s->rows[i], s->cols[i]);
+    expr += strlen(expr) + 1;
+  }
+  s->errors = minilisp_errors(e) - before;
+}
+
+// wait for the shard, write out its results and free it
+void lshard_finish(lshard *s, lbuf *out, long *errors) {
+  task_join(s->t);
+  lbuf_write(out, s->out.data, s->out.len);
+  *errors += s->errors;
+  lbuf_free(&s->text);
+  lbuf_free(&s->out);
+  free(s);
+}
+
+long eval_batch_sharded(lopts *o, lbuf *out, char *filename, FILE *f, long *errors) {
+  lreader r = { f };
+  lbuf_init(&r.expr, NULL);
+
+  int window = task_pool_size() * LSHARD_WINDOW;
+  lshard **ring = malloc(sizeof(lshard*) * window);
+  long spawned = 0, written = 0, count = 0;
+
+  int more = 1;
+  while (more) {
+    lshard *s = malloc(sizeof(lshard));
+    s->opts = o;
+    s->filename = filename;
+    s->count = 0;
+    lbuf_init(&s->text, NULL);
+    lbuf_init(&s->out, NULL);
+
+    while (s->count < LSHARD_EXPRS && (more = lreader_next(&r))) {
+      s->rows[s->count] = r.expr_row;
+      s->cols[s->count] = r.expr_col;
+      lbuf_write(&s->text, r.expr.data, r.expr.len + 1);
+      s->count++;
+    }
+
+    if (s->count == 0) {
+      free(s);
       break;
+    }
+    count += s->count;
+
+    // the window is full, make room by writing out the oldest shard
+    if (spawned - written == window)
+      lshard_finish(ring[written++ % window], out, errors);
+
+    s->t = task_spawn(lshard_run, s);
+    ring[spawned++ % window] = s;
   }
 
-  free(v);
+  while (written < spawned)
+    lshard_finish(ring[written++ % window], out, errors);
+
+  free(ring);
+  lbuf_free(&r.expr);
+  return count;
 }
 
-// add a new element x to v's list
-lval *lval_add(lval *v, lval *x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  v->cell[v->count - 1] = x;
-  return v;
+// the batch in f on the pool's workers when there are several, otherwise
+// in e on this thread
+long eval_file(lenv *e, lopts *o, lbuf *out, char *filename, FILE *f, long *errors) {
+  if (task_pool_size() > 1)
+    return eval_batch_sharded(o, out, filename, f, errors);
+  return eval_batch(e, out, filename, f, errors);
 }
 
-lval *lval_pop(lval *v, int i) {
-  lval *x = v->cell[i];
+// Readiness of file descriptors: epoll on Linux, poll elsewhere. Every
+// descriptor is registered with a pointer that comes back with its events.
+// Hangups and errors are always reported, whatever events were asked for.
+#define LWATCH_IN 1
+#define LWATCH_OUT 2
+#define LWATCH_HUP 4
 
-  // shift the array inplace removing a reference to i-th element
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count-i-1));
+typedef struct {
+  void *ptr;
+  int events;
+} lwatch_event;
 
-  // decrease the count
-  v->count--;
+#ifdef __linux__
 
-  // reallocate the memory used (as we removed one element)
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  return x;
-}
+typedef struct {
+  int fd;
+} lwatch;
 
-lval *lval_take(lval *v, int i) {
-  lval* x = lval_pop(v, i);
-  lval_del(v);
-  return x;
+lwatch *lwatch_new() {
+  lwatch *w = malloc(sizeof(lwatch));
+  w->fd = epoll_create1(0);
+  return w;
 }
 
-lval *lval_join(lval *x, lval *y) {
-  // one by one put elements from y to x
-  while (y->count > 0)
-    x = lval_add(x, lval_pop(y, 0));
-  lval_del(y);
-  return x;
+void lwatch_ctl(lwatch *w, int op, int fd, void *ptr, int events) {
+  struct epoll_event ev;
+  ev.events = (events & LWATCH_IN ? EPOLLIN : 0) | (events & LWATCH_OUT ? EPOLLOUT : 0);
+  ev.data.ptr = ptr;
+  epoll_ctl(w->fd, op, fd, &ev);
 }
 
-// deep copy of the value passed in
-lval *lval_copy(lval *x) {
-  lval *c = malloc(sizeof(lval));
-  c->type = x->type;
+void lwatch_add(lwatch *w, int fd, void *ptr, int events) {
+  lwatch_ctl(w, EPOLL_CTL_ADD, fd, ptr, events);
+}
 
-  switch (x->type) {
-    case LVAL_NUM:
-      c->num = x->num; break;
-    case LVAL_ERR:
-      c->err = malloc(strlen(x->err) + 1);
-      strcpy(c->err, x->err);
-      break;
-    case LVAL_SYM:
-      c->sym = malloc(strlen(x->sym) + 1);
-      strcpy(c->sym, x->sym);
-      break;
-    case LVAL_FUN:
-      c->fun = x->fun; break;
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-      c->count = x->count;
-      c->cell = malloc(sizeof(lval*) * c->count);
-      for (int i = 0; i < x->count; i++)
-        c->cell[i] = lval_copy(x->cell[i]);
-      break;
-  }
+void lwatch_mod(lwatch *w, int fd, void *ptr, int events) {
+  lwatch_ctl(w, EPOLL_CTL_MOD, fd, ptr, events);
+}
 
-  return c;
+void lwatch_del(lwatch *w, int fd) {
+  lwatch_ctl(w, EPOLL_CTL_DEL, fd, NULL, 0);
 }
 
-lval *lval_read_num(mpc_ast_t *t) {
-  double x;
-  int read = sscanf(t->contents, "%lf", &x);
-  return read > 0 ? lval_num(x) : lval_err("Invalid number.");
+int lwatch_wait(lwatch *w, lwatch_event *out, int max) {
+  struct epoll_event evs[max];
+  int n = epoll_wait(w->fd, evs, max, -1);
+  for (int i = 0; i < n; i++) {
+    out[i].ptr = evs[i].data.ptr;
+    out[i].events = (evs[i].events & EPOLLIN ? LWATCH_IN : 0) |
+      (evs[i].events & EPOLLOUT ? LWATCH_OUT : 0) |
+      (evs[i].events & (EPOLLHUP | EPOLLERR) ? LWATCH_HUP : 0);
+  }
+  return n;
 }
 
-lval *lval_read(mpc_ast_t* t) {
-  // for atoms, like numbers or symbols, just create a val of this type
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+#else
 
-  // otherwise it is either root or sexpr for s-expression
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+typedef struct {
+  struct pollfd *fds;
+  void **ptrs;
+  int count;
+} lwatch;
 
-  // recursively add valid expressions of s-expression
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
-  }
+lwatch *lwatch_new() {
+  return calloc(1, sizeof(lwatch));
+}
 
-  return x;
+void lwatch_mod(lwatch *w, int fd, void *ptr, int events) {
+  for (int i = 0; i < w->count; i++)
+    if (w->fds[i].fd == fd) {
+      w->fds[i].events = (events & LWATCH_IN ? POLLIN : 0) | (events & LWATCH_OUT ? POLLOUT : 0);
+      w->ptrs[i] = ptr;
+    }
 }
 
-void lval_print(lval*);
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
+void lwatch_add(lwatch *w, int fd, void *ptr, int events) {
+  w->fds = realloc(w->fds, sizeof(struct pollfd) * (w->count + 1));
+  w->ptrs = realloc(w->ptrs, sizeof(void*) * (w->count + 1));
+  w->fds[w->count].fd = fd;
+  w->count++;
+  lwatch_mod(w, fd, ptr, events);
+}
 
-  // print the whole list
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
+void lwatch_del(lwatch *w, int fd) {
+  for (int i = 0; i < w->count; i++)
+    if (w->fds[i].fd == fd) {
+      w->count--;
+      w->fds[i] = w->fds[w->count];
+      w->ptrs[i] = w->ptrs[w->count];
+      return;
+    }
+}
 
-    // no whitespace after the last element in the list
-    if (i != v->count - 1)
-      putchar(' ');
-  }
-  putchar(close);
-}
-
-void lval_print(lval* v) {
-  switch (v->type) {
-    case LVAL_NUM:
-      printf("%lf", v->num); break;
-    case LVAL_ERR:
-      printf("Error: %s", v->err); break;
-    case LVAL_SYM:
-      printf("%s", v->sym); break;
-    case LVAL_FUN:
-      printf("<function>"); break;
-    case LVAL_SEXPR:
-      lval_expr_print(v, '(', ')'); break;
-    case LVAL_QEXPR:
-      lval_expr_print(v, '{', '}'); break;
+int lwatch_wait(lwatch *w, lwatch_event *out, int max) {
+  if (poll(w->fds, w->count, -1) < 0)
+    return -1;
+  int n = 0;
+  for (int i = 0; i < w->count && n < max; i++) {
+    short r = w->fds[i].revents;
+    if (! r)
+      continue;
+    out[n].ptr = w->ptrs[i];
+    out[n].events = (r & POLLIN ? LWATCH_IN : 0) | (r & POLLOUT ? LWATCH_OUT : 0) |
+      (r & (POLLHUP | POLLERR | POLLNVAL) ? LWATCH_HUP : 0);
+    n++;
   }
+  return n;
 }
 
+#endif
 
-void lval_println(lval *v) { lval_print(v); putchar('\n'); }
-
-#define LASSERT(args, cond, err) if (!(cond)) { lval_del(args); return lval_err(err); }
-lval *builtin_head(lval *args) {
-  LASSERT(args, args->count == 1, "HEAD was passed incorrect number of arguments.");
-
-  lval* list = args->cell[0];
-  LASSERT(args, list->type == LVAL_QEXPR, "HEAD was passed incorrect type.");
+// Server mode: a request is a line of program text sent over a Unix domain
+// socket and is answered with the line the REPL would print. Clients may
+// pipeline requests; they are evaluated on the pool while the main thread
+// only moves bytes around, and answers go back in request order. Every
+// worker evaluates in a context of its own, so definitions and statistics
+// of one request never reach requests running on other workers.
+// A request longer than LSERVE_MAX_REQUEST is answered with an error and
+// the connection closed, so a client can't make the server buffer input
+// without end.
+#define LSERVE_INFLIGHT 64
+#define LSERVE_EVENTS 64
+#define LSERVE_MAX_REQUEST (1 << 20)
+
+typedef struct ljob {
+  char *input;
+  lbuf out;
+  atomic_int done;
+  task *t;
+  struct ljob *next;
+} ljob;
+
+typedef struct {
+  int fd;
+  lbuf in;        // bytes read but not cut into requests yet
+  lbuf out;       // answers, written out from `sent` on
+  size_t sent;
+  ljob *head;     // requests in flight, oldest first
+  ljob *tail;
+  int inflight;
+  int closing;    // the client stopped sending or the socket failed
+  int gone;       // the client hung up, answers are dropped
+  int events;     // what the connection is watched for
+} lconn;
+
+// finished jobs poke the main loop through this pipe
+int lserve_wake[2];
+
+// the settings for the contexts of the workers
+lopts *lserve_opts;
+
+void ljob_run(void *arg) {
+  ljob *j = arg;
+  lenv *e = lworker_context(lserve_opts);
+  if (e)
+    eval_print(e, &j->out, "<socket>", j->input, 0, 0);
+  else
+    lbuf_puts(&j->out, "Error: Unable to create an interpreter context.\n");
+  atomic_store(&j->done, 1);
+
+  char c = 0;
+  if (write(lserve_wake[1], &c, 1) < 0) {
+    // the pipe is full, so a wakeup is pending already
+  }
+}
 
-  LASSERT(args, list->count != 0, "HEAD was passed empty list ({}).");
+void lconn_request(lconn *c, char *input, size_t len) {
+  ljob *j = malloc(sizeof(ljob));
+  j->input = malloc(len + 1);
+  memcpy(j->input, input, len);
+  j->input[len] = '\0';
+  lbuf_init(&j->out, NULL);
+  atomic_init(&j->done, 0);
+  j->next = NULL;
+
+  if (c->tail)
+    c->tail->next = j;
+  else
+    c->head = j;
+  c->tail = j;
+  c->inflight++;
+
+  j->t = task_spawn(ljob_run, j);
+}
+
+// answer with an error after the requests in flight and stop reading
+void lconn_reject(lconn *c, char *error) {
+  ljob *j = malloc(sizeof(ljob));
+  j->input = NULL;
+  lbuf_init(&j->out, NULL);
+  lbuf_puts(&j->out, error);
+  atomic_init(&j->done, 1);
+  j->t = NULL;
+  j->next = NULL;
+
+  if (c->tail)
+    c->tail->next = j;
+  else
+    c->head = j;
+  c->tail = j;
+  c->inflight++;
+
+  c->in.len = 0;
+  c->closing = 1;
+}
+
+// cut complete lines out of the input, up to the in-flight limit
+void lconn_split(lconn *c) {
+  size_t start = 0;
+  for (size_t i = 0; i < c->in.len && c->inflight < LSERVE_INFLIGHT; i++) {
+    if (c->in.data[i] != '\n')
+      continue;
+    size_t end = i > start && c->in.data[i - 1] == '\r' ? i - 1 : i;
+    lconn_request(c, c->in.data + start, end - start);
+    start = i + 1;
+  }
 
-  // take frees the original args list
-  list = lval_take(args, 0);
+  // a request that runs past the limit is not waited for
+  size_t rest = c->in.len - start;
+  if (rest > LSERVE_MAX_REQUEST && ! memchr(c->in.data + start, '\n', rest)) {
+    lconn_reject(c, "Error: Request too long.\n");
+    return;
+  }
 
-  // remove the rest
-  while (list->count > 1)
-    lval_pop(list, 1);
+  // the last request doesn't need a newline
+  if (c->closing && start < c->in.len && c->inflight < LSERVE_INFLIGHT) {
+    lconn_request(c, c->in.data + start, c->in.len - start);
+    start = c->in.len;
+  }
 
-  return list;
+  memmove(c->in.data, c->in.data + start, c->in.len - start);
+  c->in.len -= start;
+}
+
+void lconn_read(lconn *c) {
+  char buf[1 << 16];
+  ssize_t n = read(c->fd, buf, sizeof(buf));
+  if (n > 0)
+    lbuf_write(&c->in, buf, n);
+  else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    c->closing = 1;
+}
+
+// the client is gone: stop watching it, drop its unread requests and
+// whatever answers are left
+void lconn_hangup(lwatch *w, lconn *c) {
+  if (c->gone)
+    return;
+  lwatch_del(w, c->fd);
+  c->gone = 1;
+  c->closing = 1;
+  c->in.len = 0;
+  c->out.len = 0;
+  c->sent = 0;
+}
+
+// move finished answers at the head of the queue to the output
+void lconn_collect(lconn *c) {
+  while (c->head && atomic_load(&c->head->done)) {
+    ljob *j = c->head;
+    c->head = j->next;
+    if (! c->head)
+      c->tail = NULL;
+    c->inflight--;
+
+    if (j->t)
+      task_join(j->t);
+    if (! c->gone)
+      lbuf_write(&c->out, j->out.data, j->out.len);
+    lbuf_free(&j->out);
+    free(j->input);
+    free(j);
+  }
 }
 
-lval *builtin_tail(lval *args) {
-  LASSERT(args, args->count == 1, "TAIL was passed incorrect number of arguments.");
-
-  lval* list = args->cell[0];
-  LASSERT(args, list->type == LVAL_QEXPR, "TAIL was passed incorrect type.");
-  LASSERT(args, list->count != 0, "TAIL was passed an empty list ({}).");
-
-  // take frees the original args list
-  list = lval_take(args, 0);
+void lconn_write(lwatch *w, lconn *c) {
+  while (c->sent < c->out.len) {
+    ssize_t n = write(c->fd, c->out.data + c->sent, c->out.len - c->sent);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return;
+      lconn_hangup(w, c);
+      return;
+    }
+    c->sent += n;
+  }
 
-  // remove the head
-  lval_del(lval_pop(list, 0));
+  c->out.len = 0;
+  c->sent = 0;
+}
 
-  return list;
+// read while there is room for more requests, write while answers wait
+void lconn_watch(lwatch *w, lconn *c) {
+  if (c->gone)
+    return;
+  int events = 0;
+  if (! c->closing && c->inflight < LSERVE_INFLIGHT)
+    events |= LWATCH_IN;
+  if (c->sent < c->out.len)
+    events |= LWATCH_OUT;
+  if (events != c->events)
+    lwatch_mod(w, c->fd, c, events);
+  c->events = events;
 }
 
-lval *builtin_list(lval *args) {
-  args->type = LVAL_QEXPR;
-  return args;
+void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 }
 
-lval *lval_eval(lval *);
-lval *builtin_eval(lval *args) {
-  LASSERT(args, args->count == 1, "EVAL was passed incorrect number of arguments.");
-  LASSERT(args, args->cell[0]->type == LVAL_QEXPR, "EVAL was passed incorrect type.");
+int serve(lopts *o, char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: Socket path too long\n", path);
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 128) < 0 || pipe(lserve_wake) < 0) {
+    perror(path);
+    return 1;
+  }
 
-  lval *list = lval_take(args, 0);
-  list->type = LVAL_SEXPR;
-  return lval_eval(list);
-}
+  set_nonblocking(listener);
+  set_nonblocking(lserve_wake[0]);
+  set_nonblocking(lserve_wake[1]);
+  signal(SIGPIPE, SIG_IGN);
+  lserve_opts = o;
 
-lval *builtin_join(lval *args) {
-  LASSERT(args, args->count != 0, "JOIN was passed 0 arguments.");
-  for (int i = 0; i < args->count; i++)
-    LASSERT(args, args->cell[i]->type == LVAL_QEXPR, "JOIN was passed incorrect type.");
+  lwatch *w = lwatch_new();
+  lwatch_add(w, listener, &listener, LWATCH_IN);
+  lwatch_add(w, lserve_wake[0], lserve_wake, LWATCH_IN);
 
-  lval *res = lval_pop(args, 0);
-  while (args->count > 0)
-    res = lval_join(res, lval_pop(args, 0));
+  lconn **conns = NULL;
+  int conns_num = 0;
+  lwatch_event events[LSERVE_EVENTS];
 
-  lval_del(args);
-  return res;
-}
+  while (1) {
+    int n = lwatch_wait(w, events, LSERVE_EVENTS);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("wait");
+      return 1;
+    }
 
-lval *builtin_cons(lval *args) {
-  LASSERT(args, args->count == 2, "CONS was passed incorrect number of arguments.");
-  LASSERT(args, args->cell[1]->type == LVAL_QEXPR, "CONS was passed incorrect type.");
+    for (int i = 0; i < n; i++) {
+      if (events[i].ptr == lserve_wake) {
+        char buf[256];
+        while (read(lserve_wake[0], buf, sizeof(buf)) > 0);
+      } else if (events[i].ptr == &listener) {
+        int fd;
+        while ((fd = accept(listener, NULL, NULL)) >= 0) {
+          set_nonblocking(fd);
+          lconn *c = calloc(1, sizeof(lconn));
+          c->fd = fd;
+          c->events = LWATCH_IN;
+          lbuf_init(&c->in, NULL);
+          lbuf_init(&c->out, NULL);
+          conns = realloc(conns, sizeof(lconn*) * (conns_num + 1));
+          conns[conns_num++] = c;
+          lwatch_add(w, fd, c, c->events);
+        }
+      } else if (events[i].events & LWATCH_HUP) {
+        // a hung up socket stays ready, so it can't stay watched
+        lconn_hangup(w, events[i].ptr);
+      } else if (events[i].events & LWATCH_IN) {
+        lconn_read(events[i].ptr);
+      }
+    }
 
-  lval *val = lval_pop(args, 0);
-  lval *list = lval_pop(args, 0);
-  lval *res = lval_qexpr();
-  lval_del(args);
+    for (int i = 0; i < conns_num; i++) {
+      lconn *c = conns[i];
+      lconn_split(c);
+      lconn_collect(c);
+      lconn_write(w, c);
+      lconn_watch(w, c);
+    }
 
-  return lval_join(lval_add(res, val), list);
+    // drop the connections that are done, keeping the rest in order
+    int kept = 0;
+    for (int i = 0; i < conns_num; i++) {
+      lconn *c = conns[i];
+      if (c->closing && ! c->head && c->in.len == 0 && c->sent == c->out.len) {
+        if (! c->gone)
+          lwatch_del(w, c->fd);
+        close(c->fd);
+        lbuf_free(&c->in);
+        lbuf_free(&c->out);
+        free(c);
+      } else {
+        conns[kept++] = c;
+      }
+    }
+    conns_num = kept;
+  }
 }
 
-lval *builtin_len(lval *args) {
-  LASSERT(args, args->count == 1, "LEN was passed incorrect number of arguments.");
-  LASSERT(args, args->cell[0]->type == LVAL_QEXPR, "LEn was passed incorrect type.");
+// Shared memory mode, see lshm.h for the layout of the rings.
 
-  lval *res = lval_num(args->cell[0]->count);
-  lval_del(args);
+// spin for a while before going to sleep between polls of the ring
+void lshm_wait(int *idle) {
+  if (++*idle < 1000)
+    return;
+  struct timespec ts = { 0, *idle < 10000 ? 0 : 50000 };
+  if (ts.tv_nsec)
+    nanosleep(&ts, NULL);
+  else
+    sched_yield();
+}
 
-  return res;
+// set by SIGINT and SIGTERM, the server then removes its object and exits
+volatile sig_atomic_t lshm_stop;
+
+void lshm_on_signal(int sig) {
+  (void)sig;
+  lshm_stop = 1;
 }
 
-lval *evaluate_op(char* op, lval *x, lval *y) {
-  // if either of operands is an error, return it
-  if (x->type == LVAL_ERR) return x;
-  if (y->type == LVAL_ERR) return y;
+// a portable shared memory object name: one leading slash and no other
+int lshm_name_valid(char *name) {
+  size_t len = strlen(name);
+  return name[0] == '/' && len > 1 && len <= NAME_MAX && ! strchr(name + 1, '/');
+}
 
+// the server creates the object and removes it again when it fails to set
+// it up or is stopped with SIGINT or SIGTERM; callers still mapping it keep
+// their mapping
+int serve_shm(lenv *e, char *name) {
+  if (! lshm_name_valid(name)) {
+    fprintf(stderr, "%s: Shared memory names are a '/' followed by up to %d other characters\n",
+        name, NAME_MAX - 1);
+    return 1;
+  }
 
-  if (! strcmp(op, "+") || ! strcmp(op, "add"))
-    return lval_num(x->num + y->num);
-  if (! strcmp(op, "-") || ! strcmp(op, "sub"))
-    return lval_num(x->num - y->num);
-  if (! strcmp(op, "*") || ! strcmp(op, "mul"))
-    return lval_num(x->num * y->num);
-  if (! strcmp(op, "/") || ! strcmp(op, "div")) {
-    // restrict the division by zero, even for doubles for now
-    if (y->num == 0.0)
-      return lval_err("Division by zero when trying to to divide.");
-    return lval_num(x->num / y->num);
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+  if (fd < 0) {
+    perror(name);
+    return 1;
   }
-  if (! strcmp(op, "%") || ! strcmp(op, "mod")) {
-    if (y->num == 0.0)
-      return lval_err("Division by zero when trying to take mod.");
-    return lval_num((double)((long)x->num % (long)y->num));
+  if (ftruncate(fd, sizeof(lshm_region)) < 0) {
+    perror(name);
+    close(fd);
+    shm_unlink(name);
+    return 1;
   }
-  if (! strcmp(op, "^") || ! strcmp(op, "pow"))
-    return lval_num(pow(x->num, y->num));
-  if (! strcmp(op, "min"))
-    return lval_num(fmin(x->num, y->num));
-  if (! strcmp(op, "max"))
-    return lval_num(fmax(x->num, y->num));
-
-  return lval_err("Bad operator.");
-}
-
-lval *builtin_op(lval *args, char *op) {
-  // all arguments should be numbers
-  for (int i = 0; i < args->count; i++)
-    if (args->cell[i]->type != LVAL_NUM) {
-      lval_del(args);
-      return lval_err("Cannot operate on non-numbers.");
-    }
 
-  // use the first argument as the base
-  lval *res = lval_pop(args, 0);
-
-  // Special case for unary minus:
-  if (args->count == 0 && strcmp("-", op) == 0)
-    res->num = -res->num;
+  lshm_region *shm = mmap(NULL, sizeof(lshm_region), PROT_READ | PROT_WRITE,
+    MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    perror(name);
+    shm_unlink(name);
+    return 1;
+  }
 
-  while (args->count > 0) {
-    lval *x = lval_pop(args, 0);
-    lval *newRes = evaluate_op(op, res, x);
-    lval_del(res);
-    lval_del(x);
+  // no SA_RESTART, so a signal also ends the sleep between polls
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lshm_on_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  memset(shm, 0, sizeof(lshm_region));
+  shm->slots = LSHM_SLOTS;
+  shm->slot_size = LSHM_SLOT_SIZE;
+  atomic_store_explicit(&shm->magic, LSHM_MAGIC, memory_order_release);
+
+  lshm_ring *req = &shm->requests;
+  lshm_ring *res = &shm->responses;
+  lbuf out;
+  lbuf_init(&out, NULL);
+  char *input = malloc(LSHM_SLOT_SIZE);
+  int idle = 0;
+
+  while (! lshm_stop) {
+    unsigned tail = atomic_load_explicit(&req->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&req->head, memory_order_acquire) == tail) {
+      lshm_wait(&idle);
+      continue;
+    }
 
-    res = newRes;
-    if (res->type == LVAL_ERR)
-      break;
+    // the caller hasn't taken the answers yet, wait for space
+    unsigned head = atomic_load_explicit(&res->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&res->tail, memory_order_acquire) == LSHM_SLOTS) {
+      lshm_wait(&idle);
+      continue;
+    }
+    idle = 0;
+
+    // the caller can still write to the slot, so only a private copy of
+    // at most a slot's worth of text is parsed
+    lshm_slot *in = &req->slots[tail % LSHM_SLOTS];
+    uint32_t len = in->len;
+    if (len > LSHM_SLOT_SIZE)
+      len = LSHM_SLOT_SIZE;
+    memcpy(input, in->data, len);
+    atomic_store_explicit(&req->tail, tail + 1, memory_order_release);
+
+    out.len = 0;
+    eval_print_n(e, &out, "<shm>", input, len, 0, 0);
+
+    lshm_slot *o = &res->slots[head % LSHM_SLOTS];
+    if (out.len >= LSHM_SLOT_SIZE) {
+      out.len = 0;
+      lbuf_puts(&out, "Error: Result too long for a shared memory slot.\n");
+    }
+    memcpy(o->data, out.data, out.len);
+    o->data[out.len] = '\0';
+    o->len = out.len;
+    atomic_store_explicit(&res->head, head + 1, memory_order_release);
   }
 
-  lval_del(args);
-  return res;
-}
-
-lval *builtin(lval *args, char *func) {
-  if (! strcmp(func, "list")) return builtin_list(args);
-  if (! strcmp(func, "head")) return builtin_head(args);
-  if (! strcmp(func, "tail")) return builtin_tail(args);
-  if (! strcmp(func, "eval")) return builtin_eval(args);
-  if (! strcmp(func, "join")) return builtin_join(args);
-  if (! strcmp(func, "cons")) return builtin_cons(args);
-  if (! strcmp(func, "len")) return builtin_len(args);
-  return builtin_op(args, func);
-}
-
-lval *lval_eval_sexpr(lval *sexpr) {
-  // evaluate all the children first
-  for (int i = 0; i < sexpr->count; i++)
-    sexpr->cell[i] = lval_eval(sexpr->cell[i]);
-
-  // check if any of the children evaluations returned an error
-  for (int i = 0; i < sexpr->count; i++)
-    if (sexpr->cell[i]->type == LVAL_ERR)
-      return lval_take(sexpr, i);
-
-  // an empty expression is resulted into an empty expression:
-  // () -> ()
-  if (sexpr->count == 0)
-    return sexpr;
-
-  // expression with a single children is resulted into this children
-  // (6) -> 6
-  if (sexpr->count == 1)
-    return lval_take(sexpr, 0);
-
-  // (sym arg arg arg ...)
-  // first child should be a symbol
-  lval *op = lval_pop(sexpr, 0);
-
-  if (op->type != LVAL_SYM) {
-    lval_del(op);
-    lval_del(sexpr);
-    return lval_err("S-expression doesn't start with a symbol.");
-  }
+  shm_unlink(name);
+  munmap(shm, sizeof(lshm_region));
+  lbuf_free(&out);
+  free(input);
+  return 0;
+}
 
-  lval *result = builtin(sexpr, op->sym);
-  lval_del(op);
-  return result;
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
 }
 
-lval *lval_eval(lval *v) {
-  // S-expression should be evaluated
-  if (v->type == LVAL_SEXPR)
-    return lval_eval_sexpr(v);
-  // evaluate to itself
-  return v;
+void usage() {
+  fprintf(stderr, "usage: prompt [--threads N] [--parallel[=NODES]] [--stats] [--image FILE] [--save-image FILE]\n"
+      "              [--max-depth N] [--max-elements N] [--max-bytes N]\n"
+      "              [--stdin | --serve SOCKET | --shm NAME | FILE...]\n");
+  exit(1);
 }
 
-void start_repl() {
-  printf("Minilisp Version 0.0.1\n");
-  printf("Press Ctrl+c to Exit\n\n");
+int main(int argc, char** argv) {
+  int batch = 0;
+  int stats = 0;
+  int files = 0;
+  int threads = 0;
+  int parallel = 0;
+  char *socket_path = NULL;
+  char *shm_name = NULL;
+  char *image = NULL;
+  char *save_image = NULL;
+  // print limits, -1 when not given
+  long max_depth = -1, max_elements = -1, max_bytes = -1;
+
+  for (int i = 1; i < argc; i++) {
+    if (! strcmp(argv[i], "--threads") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+      threads = atoi(argv[++i]);
+    else if (! strcmp(argv[i], "--parallel"))
+      parallel = 256;
+    else if (! strncmp(argv[i], "--parallel=", 11) && atoi(argv[i] + 11) > 0)
+      parallel = atoi(argv[i] + 11);
+    else if (! strcmp(argv[i], "--stats"))
+      stats = 1;
+    else if (! strcmp(argv[i], "--stdin"))
+      batch = 1;
+    else if (! strcmp(argv[i], "--serve") && i + 1 < argc)
+      socket_path = argv[++i];
+    else if (! strcmp(argv[i], "--shm") && i + 1 < argc)
+      shm_name = argv[++i];
+    else if (! strcmp(argv[i], "--image") && i + 1 < argc)
+      image = argv[++i];
+    else if (! strcmp(argv[i], "--save-image") && i + 1 < argc)
+      save_image = argv[++i];
+    else if (! strcmp(argv[i], "--max-depth") && i + 1 < argc && atol(argv[i + 1]) >= 0)
+      max_depth = atol(argv[++i]);
+    else if (! strcmp(argv[i], "--max-elements") && i + 1 < argc && atol(argv[i + 1]) >= 0)
+      max_elements = atol(argv[++i]);
+    else if (! strcmp(argv[i], "--max-bytes") && i + 1 < argc && atol(argv[i + 1]) >= 0)
+      max_bytes = atol(argv[++i]);
+    else if (argv[i][0] == '-')
+      usage();
+    else
+      argv[++files] = argv[i];
+  }
 
-  // REPL loop
-  while (1) {
-    // prompt and read the input
-    char* input = readline("minilisp> ");
+  // the REPL keeps a runaway result from flooding the terminal, other
+  // modes print in full unless asked; an image brings the limits it was
+  // saved with unless some are given here
+  int repl = ! batch && ! files && ! socket_path && ! shm_name && ! save_image;
+  if (! image || max_depth >= 0 || max_elements >= 0 || max_bytes >= 0) {
+    if (max_depth < 0)
+      max_depth = repl ? 64 : 0;
+    if (max_elements < 0)
+      max_elements = repl ? 1000 : 0;
+    if (max_bytes < 0)
+      max_bytes = repl ? (1 << 16) : 0;
+  }
 
-    // break if EOF
-    if (! input)
-      break;
+  lopts o = { image, parallel, max_depth, max_elements, max_bytes };
+  lenv *e = lopts_context(&o);
+  if (! e) {
+    fprintf(stderr, "Unable to load image %s\n", image);
+    return 1;
+  }
 
-    // add input to history
-    add_history(input);
+  if (save_image) {
+    if (minilisp_save_image(e, save_image))
+      return 0;
+    fprintf(stderr, "Unable to save image %s\n", save_image);
+    return 1;
+  }
 
-    // attempt to parse the user input
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Program, &r)) {
-      // print the result of evaluation
-      lval *x = lval_read(r.output);
-      x = lval_eval(x);
-      lval_println(x);
-      lval_del(x);
-      mpc_ast_delete(r.output);
-    } else {
-      // print the error
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+  task_pool_start(threads);
+
+  int status = 0;
+  if (socket_path) {
+    status = serve(&o, socket_path);
+  } else if (shm_name) {
+    status = serve_shm(e, shm_name);
+  } else if (! batch && ! files) {
+    start_repl(e);
+  } else {
+    lbuf out;
+    lbuf_init(&out, stdout);
+
+    double start = now();
+    long count = 0, errors = 0;
+    if (batch)
+      count += eval_file(e, &o, &out, "<stdin>", stdin, &errors);
+
+    for (int i = 1; i <= files; i++) {
+      FILE *f = fopen(argv[i], "r");
+      if (! f) {
+        lbuf_flush(&out);
+        fprintf(stderr, "Unable to open %s\n", argv[i]);
+        continue;
+      }
+      count += eval_file(e, &o, &out, argv[i], f, &errors);
+      fclose(f);
     }
 
-    // free retrived input
-    free(input);
+    lbuf_flush(&out);
+    lbuf_free(&out);
+
+    if (stats) {
+      double elapsed = now() - start;
+      fprintf(stderr, "%ld expressions, %ld errors in %.3fs (%.0f expressions/s)\n",
+          count, errors, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+    }
   }
-}
 
-int main(int argc, char** argv) {
-  define_grammar();
-  start_repl();
-  clean_grammar();
-  return 0;
+  task_pool_stop();
+  minilisp_delete(e);
+  return status;
 }
 
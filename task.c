@@ -0,0 +1,325 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "task.h"
+
+struct task {
+  task_fn fn;
+  void *arg;
+  atomic_int done;
+};
+
+static void task_run(task *t) {
+  t->fn(t->arg);
+  atomic_store_explicit(&t->done, 1, memory_order_release);
+}
+
+// Chase-Lev deque, following "Correct and Efficient Work-Stealing for Weak
+// Memory Models" (Le et al., 2013). Only the owner pushes and takes at the
+// bottom, any thread may steal from the top.
+typedef struct deque_array {
+  long size;
+  struct deque_array *prev;   // retired arrays, stealers may still read them
+  _Atomic(task*) buf[];
+} deque_array;
+
+typedef struct {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(deque_array*) array;
+} deque;
+
+#define DEQUE_INITIAL_SIZE 64
+#define DEQUE_ABORT ((task*)1)
+
+static deque_array *deque_array_new(long size, deque_array *prev) {
+  deque_array *a = malloc(sizeof(deque_array) + sizeof(_Atomic(task*)) * size);
+  a->size = size;
+  a->prev = prev;
+  return a;
+}
+
+static void deque_init(deque *d) {
+  atomic_init(&d->top, 0);
+  atomic_init(&d->bottom, 0);
+  atomic_init(&d->array, deque_array_new(DEQUE_INITIAL_SIZE, NULL));
+}
+
+static void deque_free(deque *d) {
+  deque_array *a = atomic_load(&d->array);
+  while (a) {
+    deque_array *prev = a->prev;
+    free(a);
+    a = prev;
+  }
+}
+
+// double the array, keeping the old one alive for concurrent stealers
+static deque_array *deque_grow(deque *d, deque_array *a, long top, long bottom) {
+  deque_array *n = deque_array_new(a->size * 2, a);
+  for (long i = top; i < bottom; i++) {
+    task *t = atomic_load_explicit(&a->buf[i % a->size], memory_order_relaxed);
+    atomic_store_explicit(&n->buf[i % n->size], t, memory_order_relaxed);
+  }
+  atomic_store_explicit(&d->array, n, memory_order_release);
+  return n;
+}
+
+static void deque_push(deque *d, task *t) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&d->top, memory_order_acquire);
+  deque_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+
+  if (b - top > a->size - 1)
+    a = deque_grow(d, a, top, b);
+
+  atomic_store_explicit(&a->buf[b % a->size], t, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static task *deque_take(deque *d) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  deque_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+  // the deque was empty
+  if (top > b) {
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  task *t = atomic_load_explicit(&a->buf[b % a->size], memory_order_relaxed);
+
+  // last element, race against the stealers for it
+  if (top == b) {
+    if (! atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+          memory_order_seq_cst, memory_order_relaxed))
+      t = NULL;
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+
+  return t;
+}
+
+static task *deque_steal(deque *d) {
+  long top = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+  if (top >= b)
+    return NULL;
+
+  deque_array *a = atomic_load_explicit(&d->array, memory_order_acquire);
+  task *t = atomic_load_explicit(&a->buf[top % a->size], memory_order_relaxed);
+  if (! atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed))
+    return DEQUE_ABORT;
+
+  return t;
+}
+
+// The pool itself. Threads that aren't workers submit through `inject`,
+// sleeping workers are woken up through `wake` when work shows up.
+typedef struct injected {
+  task *t;
+  struct injected *next;
+} injected;
+
+static struct {
+  int size;
+  pthread_t *threads;
+  deque *deques;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  injected *inject_head;
+  injected *inject_tail;
+  atomic_int injected_num;
+
+  atomic_int pending;   // tasks queued but not started yet
+  atomic_int sleepers;
+  atomic_int stop;
+} pool;
+
+static _Thread_local int worker_id = -1;
+static _Thread_local unsigned int steal_seed = 1;
+
+static task *pool_pop_injected(void) {
+  if (atomic_load(&pool.injected_num) == 0)
+    return NULL;
+
+  pthread_mutex_lock(&pool.lock);
+  injected *i = pool.inject_head;
+  if (i) {
+    pool.inject_head = i->next;
+    if (! pool.inject_head)
+      pool.inject_tail = NULL;
+    atomic_fetch_sub(&pool.injected_num, 1);
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (! i)
+    return NULL;
+  task *t = i->t;
+  free(i);
+  return t;
+}
+
+// find a task to run: own deque first, then injected work, then a victim
+static task *pool_find(void) {
+  task *t = NULL;
+
+  if (worker_id >= 0)
+    t = deque_take(&pool.deques[worker_id]);
+  if (! t)
+    t = pool_pop_injected();
+
+  for (int n = 0; ! t && n < pool.size * 2; n++) {
+    steal_seed = steal_seed * 1103515245 + 12345;
+    int victim = (steal_seed >> 16) % pool.size;
+    if (victim == worker_id)
+      continue;
+    t = deque_steal(&pool.deques[victim]);
+    if (t == DEQUE_ABORT)
+      t = NULL;
+  }
+
+  if (t)
+    atomic_fetch_sub(&pool.pending, 1);
+  return t;
+}
+
+static void *pool_worker(void *arg) {
+  worker_id = (int)(long)arg;
+  steal_seed = worker_id + 1;
+
+  while (! atomic_load(&pool.stop)) {
+    task *t = pool_find();
+    if (t) {
+      task_run(t);
+      continue;
+    }
+
+    // nothing to do, sleep until a spawn signals new work
+    pthread_mutex_lock(&pool.lock);
+    atomic_fetch_add(&pool.sleepers, 1);
+    while (atomic_load(&pool.pending) == 0 && ! atomic_load(&pool.stop))
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    atomic_fetch_sub(&pool.sleepers, 1);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  return NULL;
+}
+
+void task_pool_start(int n) {
+  if (pool.size)
+    return;
+
+  if (n <= 0)
+    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n <= 0)
+    n = 1;
+
+  pool.size = n;
+  pool.threads = malloc(sizeof(pthread_t) * n);
+  pool.deques = malloc(sizeof(deque) * n);
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  pool.inject_head = NULL;
+  pool.inject_tail = NULL;
+  atomic_init(&pool.injected_num, 0);
+  atomic_init(&pool.pending, 0);
+  atomic_init(&pool.sleepers, 0);
+  atomic_init(&pool.stop, 0);
+
+  for (int i = 0; i < n; i++)
+    deque_init(&pool.deques[i]);
+  for (int i = 0; i < n; i++)
+    pthread_create(&pool.threads[i], NULL, pool_worker, (void*)(long)i);
+}
+
+void task_pool_stop(void) {
+  if (! pool.size)
+    return;
+
+  pthread_mutex_lock(&pool.lock);
+  atomic_store(&pool.stop, 1);
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (int i = 0; i < pool.size; i++)
+    pthread_join(pool.threads[i], NULL);
+  for (int i = 0; i < pool.size; i++)
+    deque_free(&pool.deques[i]);
+
+  free(pool.threads);
+  free(pool.deques);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.wake);
+  pool.size = 0;
+}
+
+int task_pool_size(void) {
+  return pool.size;
+}
+
+task *task_spawn(task_fn fn, void *arg) {
+  task *t = malloc(sizeof(task));
+  t->fn = fn;
+  t->arg = arg;
+  atomic_init(&t->done, 0);
+
+  if (! pool.size) {
+    task_run(t);
+    return t;
+  }
+
+  atomic_fetch_add(&pool.pending, 1);
+
+  if (worker_id >= 0) {
+    deque_push(&pool.deques[worker_id], t);
+  } else {
+    injected *i = malloc(sizeof(injected));
+    i->t = t;
+    i->next = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.inject_tail)
+      pool.inject_tail->next = i;
+    else
+      pool.inject_head = i;
+    pool.inject_tail = i;
+    atomic_fetch_add(&pool.injected_num, 1);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  if (atomic_load(&pool.sleepers) > 0) {
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  return t;
+}
+
+void task_join(task *t) {
+  // help with the other tasks instead of blocking
+  while (! atomic_load_explicit(&t->done, memory_order_acquire)) {
+    task *other = pool.size ? pool_find() : NULL;
+    if (other)
+      task_run(other);
+    else
+      sched_yield();
+  }
+
+  free(t);
+}
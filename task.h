@@ -0,0 +1,29 @@
+#ifndef task_h
+#define task_h
+
+// Work-stealing task pool.
+//
+// Every worker thread owns a Chase-Lev deque: it pushes and pops tasks at
+// the bottom while idle workers steal from the top of the others. Threads
+// outside of the pool (like the main thread) hand their tasks over through
+// a shared queue, and anyone waiting in task_join runs other tasks
+// meanwhile, so nested spawn/join from inside a task never blocks a worker.
+
+typedef void (*task_fn)(void *arg);
+
+typedef struct task task;
+
+// start n worker threads, n <= 0 starts one per online core
+void task_pool_start(int n);
+void task_pool_stop(void);
+
+// number of worker threads, 0 when the pool isn't running
+int task_pool_size(void);
+
+// run fn(arg) in the pool; without a pool it runs right away
+task *task_spawn(task_fn fn, void *arg);
+
+// wait for t to finish and free it
+void task_join(task *t);
+
+#endif
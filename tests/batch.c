@@ -0,0 +1,93 @@
+// Batch mode: a file of lines typed at the REPL gives the same output from
+// ./prompt file, with one worker and with several, as the REPL does.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+const char *lines[] = {
+  "+ 1 2",
+  "head {1 2 3}",
+  "tail {1 2 3}",
+  "list 1 2 3",
+  "(+ 1 2)",
+  "(head {1 2})",
+  "eval {+ 1 (* 2 3)}",
+  "- (+ 1 2) 4",
+  "join {1} {2 3} {4}",
+  "* {1 2} 3",
+  "5",
+  "{1 2 {3}}",
+  "foo 1 2",
+  "/ 1 0",
+  "head 1",
+  "",
+  "  + 10   20  ",
+  NULL
+};
+
+// everything the command prints
+char *run(const char *command) {
+  FILE *p = popen(command, "r");
+  lbuf b;
+  lbuf_init(&b, NULL);
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), p)) > 0)
+    lbuf_write(&b, chunk, n);
+  CHECK(pclose(p) == 0, "%s failed", command);
+  lbuf_putc(&b, '\0');
+  return b.data;
+}
+
+int main(void) {
+  char path[] = "/tmp/minilisp-batch-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *f = fdopen(fd, "w");
+
+  // what the REPL prints, a line at a time; empty lines print nothing
+  lenv *e = minilisp_new();
+  lbuf want;
+  lbuf_init(&want, NULL);
+  // enough copies that several workers each get some
+  for (int k = 0; k < 200; k++) {
+    for (int i = 0; lines[i]; i++) {
+      fprintf(f, "%s\n", lines[i]);
+      if (strspn(lines[i], " ") != strlen(lines[i]))
+        eval_print(e, &want, "<stdin>", (char*)lines[i], 0, 0);
+    }
+  }
+  lbuf_putc(&want, '\0');
+  fclose(f);
+  minilisp_delete(e);
+
+  const char *commands[] = { "./prompt --threads 1 %s", "./prompt --threads 4 %s" };
+  for (int i = 0; i < 2; i++) {
+    char command[128];
+    snprintf(command, sizeof(command), commands[i], path);
+    char *got = run(command);
+    CHECK(! strcmp(got, want.data), "%s printed something else than the REPL:\n%.400s", command, got);
+    free(got);
+  }
+
+  remove(path);
+  lbuf_free(&want);
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}
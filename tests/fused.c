@@ -0,0 +1,122 @@
+// Fused elementwise arithmetic: nested operators on lists evaluate to the
+// same values and the same errors as evaluating one operator at a time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// the program in text evaluated with and without fusing, printed
+char *eval_text(lenv *e, const char *text, int fuse) {
+  lval *v = lscan_read(text, strlen(text));
+  if (! v)
+    return NULL;
+  v = lval_eval_in(e, v, fuse);
+  char *s = minilisp_format(v);
+  lval_del(v);
+  return s;
+}
+
+void check(lenv *e, const char *text) {
+  char *fused = eval_text(e, text, 1), *plain = eval_text(e, text, 0);
+  CHECK(fused && plain && ! strcmp(fused, plain), "%s gave %s fused and %s one operator at a time",
+      text, fused ? fused : "nothing", plain ? plain : "nothing");
+  free(fused);
+  free(plain);
+}
+
+const char *cases[] = {
+  "(+ {1 2} (* {3 4} 2))",
+  "(- (- {1 2}))",
+  "(* (+ 1 2) (- {4 5 6} 1) 2)",
+  "(/ (+ {1 2} 1) (- {1 2} 1))",      // division by zero in one element
+  "(+ {1 2} (* {1 2 3} 2))",           // lists of different lengths
+  "(+ {1 a} (* {1 2} 2))",             // a list that isn't numeric
+  "(+ {1 2} (* {} 2))",
+  "(+ {} (* {} 2))",
+  "(+ 1 (* 2 3))",                     // no list at all
+  "(+ {1 2} (head {3 4}))",            // an operand that isn't arithmetic
+  "(+ {1 2} (* {3 4} foo))",
+  "(+ (* {1 2} 2) (- (/ {8 4} 2) (* {1 1} 3)))",
+  NULL
+};
+
+unsigned long state = 88172645463325252ul;
+
+int next(int n) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state % n;
+}
+
+// a random expression of operators over numbers and lists of length len,
+// now and then with something that can't be fused
+void expr(lbuf *b, int depth, int len) {
+  int r = next(20);
+  if (depth == 0 || r < 6) {
+    if (r < 2) {
+      lbuf_printf(b, "%d", next(7) - 3);
+    } else if (r == 2 && next(4) == 0) {
+      lbuf_puts(b, next(2) ? "{1 x}" : "{1 2 3 4 5 6 7 8 9}");
+    } else {
+      lbuf_putc(b, '{');
+      for (int i = 0; i < len; i++)
+        lbuf_printf(b, i ? " %d" : "%d", next(9) - 4);
+      lbuf_putc(b, '}');
+    }
+    return;
+  }
+
+  static const char *ops[] = { "+", "-", "*", "/" };
+  int argc = 1 + next(3);
+  lbuf_printf(b, "(%s", ops[next(4)]);
+  for (int i = 0; i < argc; i++) {
+    lbuf_putc(b, ' ');
+    expr(b, depth - 1, len);
+  }
+  lbuf_putc(b, ')');
+}
+
+int main(void) {
+  lenv *e = minilisp_new();
+
+  for (int i = 0; cases[i]; i++)
+    check(e, cases[i]);
+
+  lbuf b;
+  lbuf_init(&b, NULL);
+  for (int i = 0; i < 20000; i++) {
+    b.len = 0;
+    expr(&b, 1 + next(5), next(5));
+    check(e, b.data);
+  }
+  lbuf_free(&b);
+
+  // deep nesting is compiled once, not once for every level
+  lbuf_init(&b, NULL);
+  for (int i = 0; i < 20000; i++)
+    lbuf_puts(&b, "(+ {1 2} ");
+  lbuf_puts(&b, "{1 2}");
+  for (int i = 0; i < 20000; i++)
+    lbuf_putc(&b, ')');
+  check(e, b.data);
+  lbuf_free(&b);
+
+  minilisp_delete(e);
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}
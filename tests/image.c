@@ -0,0 +1,110 @@
+// Images: a saved context loads back with the same settings, and damaged
+// or crafted images are rejected rather than read past their end.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+char path[] = "/tmp/minilisp-image-XXXXXX";
+
+void write_file(const void *data, size_t len) {
+  FILE *f = fopen(path, "wb");
+  fwrite(data, 1, len, f);
+  fclose(f);
+}
+
+// an image header claiming count builtins, followed by a few real ones
+void header(uint32_t version, uint32_t count) {
+  lbuf b;
+  lbuf_init(&b, NULL);
+  uint32_t h[] = { 0x4d494c4d, version, 0, 0 };
+  uint64_t limits[] = { 0, 0 };
+  lbuf_write(&b, (char*)h, sizeof(h));
+  lbuf_write(&b, (char*)limits, sizeof(limits));
+  lbuf_write(&b, (char*)&count, sizeof(count));
+  for (int i = 0; i < 8; i++) {
+    uint32_t len = 4;
+    lbuf_write(&b, (char*)&len, sizeof(len));
+    lbuf_puts(&b, i % 2 ? "head" : "tail");
+  }
+  write_file(b.data, b.len);
+  lbuf_free(&b);
+}
+
+int main(void) {
+  close(mkstemp(path));
+
+  lenv *e = minilisp_new();
+  CHECK(minilisp_save_image(e, path), "image not saved");
+  lenv *loaded = minilisp_load_image(path);
+  CHECK(loaded, "saved image not loaded");
+  if (loaded) {
+    const char *text = "+ 1 (eval (head {(* 2 3) 4}))";
+    lval *v = minilisp_eval(loaded, text, strlen(text));
+    char *s = minilisp_format(v);
+    CHECK(! strcmp(s, "7"), "loaded context evaluated %s to %s", text, s);
+    free(s);
+    minilisp_free(v);
+    minilisp_delete(loaded);
+  }
+
+  // the print limits come back
+  minilisp_set_print_limits(e, 2, 3, 0);
+  CHECK(minilisp_save_image(e, path), "image not saved");
+  loaded = minilisp_load_image(path);
+  CHECK(loaded, "saved image not loaded");
+  if (loaded) {
+    lbuf out;
+    lbuf_init(&out, NULL);
+    eval_print(loaded, &out, "<test>", "{1 {2 {3}} 4 5}", 0, 0);
+    CHECK(! strcmp(out.data, "{1 {2 {...}} 4 ...}\n"), "loaded context printed %s", out.data);
+    lbuf_free(&out);
+    minilisp_delete(loaded);
+  }
+  minilisp_set_print_limits(e, 0, 0, 0);
+
+  // counts that overflow the builtin arrays, or are more than there are
+  uint32_t counts[] = { UINT32_MAX, UINT32_MAX / sizeof(void*) + 1, 1000 };
+  for (int i = 0; i < 3; i++) {
+    header(2, counts[i]);
+    CHECK(! minilisp_load_image(path), "image with %u builtins loaded", counts[i]);
+  }
+
+  // every truncation of a valid image
+  minilisp_save_image(e, path);
+  FILE *f = fopen(path, "rb");
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  char *data = malloc(size);
+  CHECK(fread(data, 1, size, f) == size, "image not read back");
+  fclose(f);
+  for (long n = 1; n < size; n += n < 64 ? 1 : 97) {
+    write_file(data, n);
+    CHECK(! minilisp_load_image(path), "image cut to %ld of %ld bytes loaded", n, size);
+  }
+  free(data);
+
+  minilisp_delete(e);
+  remove(path);
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}
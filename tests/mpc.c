@@ -0,0 +1,120 @@
+// mpc on its own: parsers redefined after their grammar was analysed must
+// parse by their new definition, and not by what `or` dispatch worked out
+// for the old one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpc.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// p parses input into the string want, or fails to with want NULL
+void check_string(mpc_parser_t *p, const char *input, const char *want) {
+  mpc_result_t r;
+  if (mpc_parse_n("input", input, strlen(input), p, &r)) {
+    CHECK(want && ! strcmp(r.output, want), "\"%s\" parsed as \"%s\"", input, (char*)r.output);
+    free(r.output);
+  } else {
+    CHECK(! want, "\"%s\" didn't parse", input);
+    mpc_err_delete(r.error);
+  }
+}
+
+mpc_val_t *other(mpc_val_t *x) {
+  free(x);
+  char *s = malloc(6);
+  strcpy(s, "other");
+  return s;
+}
+
+// a rule under the first alternative of an `or`, whose second one takes
+// anything
+void redefine_combinators(void) {
+  mpc_parser_t *a = mpc_new("a");
+  mpc_parser_t *top = mpc_new("top");
+  mpc_define(a, mpc_char('x'));
+  mpc_define(top, mpc_and(2, mpcf_fst_free,
+      mpc_or(2,
+        mpc_and(2, mpcf_strfold, a, mpc_char('!'), free),
+        mpc_apply(mpc_many1(mpcf_strfold, mpc_any()), other)),
+      mpc_eoi(), free));
+  mpc_analyse(top);
+  check_string(top, "x!", "x!");
+  check_string(top, "z!", "other");
+
+  mpc_define(a, mpc_char('z'));
+  check_string(top, "z!", "z!");
+  check_string(top, "x!", "other");
+
+  // and once analysed again
+  mpc_analyse(top);
+  check_string(top, "z!", "z!");
+  check_string(top, "x!", "other");
+
+  mpc_undefine(a);
+  check_string(top, "z!", "other");
+  mpc_define(a, mpc_many1(mpcf_strfold, mpc_digit()));
+  check_string(top, "42!", "42!");
+  check_string(top, "z!", "other");
+
+  mpc_cleanup(2, a, top);
+}
+
+// p parses input into an AST whose first item is tagged want
+void check_tag(mpc_parser_t *p, const char *input, const char *want) {
+  mpc_result_t r;
+  if (mpc_parse("input", input, p, &r)) {
+    mpc_ast_t *a = r.output;
+    CHECK(a->children_num > 1 && strstr(a->children[1]->tag, want),
+        "\"%s\" parsed as %s", input, a->children_num > 1 ? a->children[1]->tag : "nothing");
+    mpc_ast_delete(a);
+  } else {
+    CHECK(0, "\"%s\" didn't parse", input);
+    mpc_err_delete(r.error);
+  }
+}
+
+// the same through mpca_lang, which analyses the rules it defines
+void redefine_lang(void) {
+  mpc_parser_t *top = mpc_new("top");
+  mpc_parser_t *item = mpc_new("item");
+  mpc_parser_t *word = mpc_new("word");
+  mpc_err_t *err = mpca_lang(MPC_LANG_DEFAULT,
+      " top  : /^/ <item> /$/ ;           "
+      " item : <word> | /[A-Z0-9]+/ ;     "
+      " word : /[a-z]+/ ;                 ",
+      top, item, word, NULL);
+  CHECK(! err, "grammar didn't compile");
+  if (err) {
+    mpc_err_delete(err);
+    return;
+  }
+  check_tag(top, "abc", "word");
+  check_tag(top, "ABC", "regex");
+
+  mpc_define(word, mpc_apply(mpc_re("[A-Z]+"), mpcf_str_ast));
+  check_tag(top, "ABC", "word");
+  check_tag(top, "123", "regex");
+
+  mpc_cleanup(3, top, item, word);
+}
+
+int main(void) {
+  redefine_combinators();
+  redefine_lang();
+
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}
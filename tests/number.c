@@ -0,0 +1,140 @@
+// Number printing: every double prints as text that reads back as the same
+// double, with no more digits than it needs.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// the fewest correctly rounded digits of positive x that read back as x,
+// found by trying every precision
+int shortest(double x, char *digits, int *exp) {
+  char buf[32];
+  for (int p = 1; p <= 17; p++) {
+    snprintf(buf, sizeof(buf), "%.*e", p - 1, x);
+    if (strtod(buf, NULL) == x)
+      break;
+  }
+  int n = 0;
+  char *c = buf;
+  for (; *c != 'e'; c++)
+    if (*c != '.')
+      digits[n++] = *c;
+  *exp = atoi(c + 1);
+  return n;
+}
+
+void check(double x) {
+  if (! isfinite(x) || x == 0)
+    return;
+  x = fabs(x);
+
+  char d[32], e[32];
+  int exp, eexp;
+  int n = lnum_digits(x, d, &exp);
+  int en = shortest(x, e, &eexp);
+  snprintf(e + en, sizeof(e) - en, "e%d", eexp - en + 1);
+  CHECK(n <= en, "%.17g: %.*s e%d is longer than %s", x, n, d, exp, e);
+
+  // the digits read back as x; below a power of two the shortest digits
+  // can be above x, elsewhere they are the closest ones
+  char s[LNUM_MAX];
+  snprintf(s, sizeof(s), "%.*se%d", n, d, exp - n + 1);
+  CHECK(strtod(s, NULL) == x, "%.17g: digits %s read back as %.17g", x, s, strtod(s, NULL));
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  if (bits & 0x000fffffffffffff)
+    CHECK(n == en && ! memcmp(d, e, n), "%.17g: digits %s, expected %s", x, s, e);
+
+  for (int sign = 0; sign < 2; sign++) {
+    double y = sign ? -x : x;
+    int len = lnum_format(s, y);
+    s[len] = '\0';
+    CHECK(len > 0 && len < LNUM_MAX && strtod(s, NULL) == y,
+        "%.17g printed as %s", y, s);
+  }
+}
+
+double from_bits(uint64_t bits) {
+  double x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+uint64_t state = 0x2545f4914f6cdd1d;
+
+uint64_t rand64(void) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+int main(void) {
+  // values that come out of arithmetic rather than the reader
+  check(0.1 + 0.2);
+  check(1.0 / 3);
+  check(2.0 / 3);
+  check(sqrt(2));
+  check(4 * atan(1));
+  check(exp(1));
+  for (int i = 1; i <= 1000; i++) {
+    check(i / 7.0);
+    check(i * 0.1);
+    check(1.0 / i);
+  }
+
+  // the extremes, including the denormals
+  check(5e-324);
+  check(1e-323);
+  check(2.2250738585072009e-308);
+  check(2.2250738585072014e-308);
+  check(1.7976931348623157e308);
+  check(from_bits(0x000fffffffffffff));
+  check(from_bits(0x0000000000000fff));
+
+  // powers of two, where the interval of numbers that read as x is
+  // narrower below than above, and their neighbours
+  for (int k = -1074; k <= 1023; k++) {
+    double x = ldexp(1, k);
+    check(x);
+    check(nextafter(x, 0));
+    check(nextafter(x, INFINITY));
+  }
+
+  // powers of ten and their neighbours
+  for (int k = -323; k <= 308; k++) {
+    char s[16];
+    snprintf(s, sizeof(s), "1e%d", k);
+    double x = strtod(s, NULL);
+    check(x);
+    check(nextafter(x, 0));
+    check(nextafter(x, INFINITY));
+  }
+
+  // integers with 15 to 17 digits
+  for (int i = 0; i < 50000; i++)
+    check((double)(rand64() >> (rand64() % 14)));
+
+  // any bit pattern
+  for (int i = 0; i < 20000; i++)
+    check(from_bits(rand64()));
+
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}
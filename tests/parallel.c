@@ -0,0 +1,73 @@
+// pmap and preduce give the same results with any number of workers, down
+// to the rounding of floating point sums.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minilisp_internal.h"
+#include "task.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+char *eval_text(const char *text) {
+  lenv *e = minilisp_new();
+  lval *v = minilisp_eval(e, text, strlen(text));
+  char *s = minilisp_format(v);
+  minilisp_free(v);
+  minilisp_delete(e);
+  return s;
+}
+
+int main(void) {
+  // numbers whose sum depends on the order it is taken in
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lbuf_puts(&b, "{");
+  unsigned long state = 12345;
+  for (int i = 0; i < 20000; i++) {
+    state = state * 6364136223846793005ul + 1442695040888963407ul;
+    lbuf_printf(&b, " %ld.%ld", (long)(state >> 40) * (i % 2 ? 1 : -1) * 100003, (long)(state >> 50));
+  }
+  lbuf_puts(&b, "}");
+  lbuf sum, map;
+  lbuf_init(&sum, NULL);
+  lbuf_init(&map, NULL);
+  lbuf_printf(&sum, "preduce {+} %s", b.data);
+  lbuf_printf(&map, "pmap {* 3} %s", b.data);
+
+  char *first_sum = NULL, *first_map = NULL;
+  for (int threads = 1; threads <= 8; threads *= 2) {
+    task_pool_start(threads);
+    char *s = eval_text(sum.data), *m = eval_text(map.data);
+    task_pool_stop();
+
+    if (! first_sum) {
+      first_sum = s;
+      first_map = m;
+      continue;
+    }
+    CHECK(! strcmp(s, first_sum), "preduce gave %s with %d workers and %s with 1", s, threads, first_sum);
+    CHECK(! strcmp(m, first_map), "pmap gave something else with %d workers", threads);
+    free(s);
+    free(m);
+  }
+
+  free(first_sum);
+  free(first_map);
+  lbuf_free(&b);
+  lbuf_free(&sum);
+  lbuf_free(&map);
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}
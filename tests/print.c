@@ -0,0 +1,75 @@
+// Printing with limits: elided parts are marked with "..." and the output
+// stays within about the byte limit for lists and matrices alike.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// the result of the program in text printed with the given limits
+void expect(lenv *e, const char *text, int depth, long elements, size_t bytes, const char *want) {
+  lval *v = minilisp_eval(e, text, strlen(text));
+  lprint_limits l = {depth, elements, bytes};
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lval_print_limited(&b, v, &l);
+  CHECK(! strcmp(b.data, want), "%s printed as %s, expected %s", text, b.data, want);
+  lbuf_free(&b);
+  minilisp_free(v);
+}
+
+int main(void) {
+  lenv *e = minilisp_new();
+
+  expect(e, "{1 2 3 4}", 0, 0, 0, "{1 2 3 4}");
+  expect(e, "{1 2 3 4}", 0, 2, 0, "{1 2 ...}");
+  expect(e, "{1 {2 {3}}}", 1, 0, 0, "{1 {...}}");
+  expect(e, "{1 2 3 4}", 0, 0, 4, "{1 2 ...}");
+
+  expect(e, "matrix {{1 2 3} {4 5 6}}", 0, 0, 0, "[[1 2 3] [4 5 6]]");
+  expect(e, "matrix {{1 2 3} {4 5 6}}", 0, 2, 0, "[[1 2 ...] [4 5 ...]]");
+  expect(e, "matrix {{1 2 3} {4 5 6}}", 0, 0, 5, "[[1 2 ...]]");
+  expect(e, "matrix {{1 2 3} {4 5 6}}", 0, 0, 11, "[[1 2 3] [4 ...]]");
+  expect(e, "list 1 (matrix {{1 2} {3 4}})", 0, 0, 7, "{1 [[1 ...]]}");
+
+  // only bytes set on a large matrix
+  enum { N = 500 };
+  lbuf text;
+  lbuf_init(&text, NULL);
+  lbuf_puts(&text, "matrix {");
+  for (int i = 0; i < N; i++) {
+    lbuf_putc(&text, '{');
+    for (int j = 0; j < N; j++)
+      lbuf_printf(&text, "%d.5 ", i * j);
+    lbuf_putc(&text, '}');
+  }
+  lbuf_putc(&text, '}');
+  lval *v = minilisp_eval(e, text.data, text.len);
+  CHECK(minilisp_type(v) == LVAL_MAT, "no %dx%d matrix", N, N);
+  lprint_limits l = {0, 0, 100};
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lval_print_limited(&b, v, &l);
+  CHECK(b.len < 200, "a %dx%d matrix printed as %zu bytes with a limit of 100", N, N, b.len);
+  CHECK(b.len >= 5 && ! strcmp(b.data + b.len - 5, "...]]"), "a %dx%d matrix printed as %s", N, N, b.data);
+  lbuf_free(&b);
+  lbuf_free(&text);
+  minilisp_free(v);
+
+  minilisp_delete(e);
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,148 @@
+// The structural scanner against the mpc readers: for every input either
+// all of them reject it, or they all read the same value.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+// print s with the bytes that don't print escaped
+void show(const char *s, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c >= ' ' && c < 127 && c != '\\')
+      fputc(c, stderr);
+    else
+      fprintf(stderr, "\\x%02x", c);
+  }
+}
+
+// the printed form of v, NULL for no value
+char *format(lval *v) {
+  if (! v)
+    return NULL;
+  char *s = minilisp_format(v);
+  lval_del(v);
+  return s;
+}
+
+int same(const char *a, const char *b) {
+  return a == b || (a && b && ! strcmp(a, b));
+}
+
+void check(lenv *e, const char *s, size_t len) {
+  char *scan = format(lscan_read(s, len));
+  char *mpc = format(lread_mpc(e, s, len));
+  char *ast = format(lread_ast(e, s, len));
+
+  if (! same(scan, mpc) || ! same(mpc, ast)) {
+    failures++;
+    fprintf(stderr, "input \"");
+    show(s, len);
+    fprintf(stderr, "\"\n  scan: %s\n  mpc:  %s\n  ast:  %s\n",
+        scan ? scan : "(rejected)", mpc ? mpc : "(rejected)", ast ? ast : "(rejected)");
+  }
+
+  free(scan);
+  free(mpc);
+  free(ast);
+}
+
+const char *corpus[] = {
+  "", " ", "\t\n\v\f\r ",
+  "1", "-1", "-", "--1", "1-", "1-2", "-1.5", "1.", ".5", "1.5.5", "1..5", "-.5", "007",
+  "a", "a1", "1a", "a-1", "+", "+1", "*-/", "a\\b", "<=", "!&", "_x_",
+  "()", "{}", "(())", "({})", "{()}", "(", ")", "{", "}", "(}", "{)", "())", "(()",
+  "+ 1 2", "(+ 1 2)", "+ 1 (* 2 3)", "{1 2 3}", "head {1 2 3}", "eval {+ 1 (* 2 3)}",
+  "(def {x} 100)", "(add 12.5 {x -3 foo} 42)", "1(2)3", "a{b}c", "{1}{2}",
+  "\"str\"", "#", "a.b", "1.a", "a;b", "a,b", "x'", "\x80", "a\xff" "b",
+  "  (  +   1\n\t2  )  ", "{{{{{{{{{{}}}}}}}}}}", "(((((((((((((((((((((1)))))))))))))))))))))",
+  NULL
+};
+
+// random programs mostly made of grammar characters, more or less balanced
+void random_input(char *s, size_t len) {
+  static const char *alphabet[] = {
+    "(", ")", "{", "}", " ", "  ", "\n", "\t", "\v", "\r",
+    "1", "23", "-", "-4", "5.6", ".", "0.", "-7.89",
+    "a", "xy", "+", "*", "/", "\\", "=", "<", ">", "!", "&", "_", "Z9",
+    "\"", "#", ";", "\x01", "\x7f", "\xc3\xa9",
+  };
+  int n = sizeof(alphabet) / sizeof(alphabet[0]);
+  size_t at = 0;
+  while (at < len) {
+    const char *piece = alphabet[rand() % n];
+    size_t k = strlen(piece);
+    if (at + k > len)
+      k = len - at;
+    memcpy(s + at, piece, k);
+    at += k;
+  }
+}
+
+// a well formed program of about len bytes: lists, numbers and symbols
+void random_program(char *s, size_t len) {
+  static const char *atoms[] = { "1", "-2", "3.25", "x", "foo", "+", "-", "*", "head", "-0.5", "a-1" };
+  int n = sizeof(atoms) / sizeof(atoms[0]);
+  int depth = 0;
+  size_t at = 0;
+  char open[256];
+  while (at + depth + 8 < len) {
+    int r = rand() % 8;
+    if (r == 0 && depth < 256) {
+      open[depth++] = rand() % 2 ? '(' : '{';
+      s[at++] = open[depth - 1];
+    } else if (r == 1 && depth > 0) {
+      s[at++] = open[--depth] == '(' ? ')' : '}';
+    } else {
+      const char *a = atoms[rand() % n];
+      memcpy(s + at, a, strlen(a));
+      at += strlen(a);
+    }
+    // separators of all kinds, and none between brackets
+    if (rand() % 4)
+      s[at++] = " \t\n "[rand() % 4];
+  }
+  while (depth > 0)
+    s[at++] = open[--depth] == '(' ? ')' : '}';
+  memset(s + at, ' ', len - at);
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+  lenv *e = minilisp_new();
+
+  for (int i = 0; corpus[i]; i++)
+    check(e, corpus[i], strlen(corpus[i]));
+
+  // inputs with a NUL inside, which only bounded readers see past
+  check(e, "1\0 2", 4);
+  check(e, "(a\0)", 4);
+
+  // tokens and brackets on both sides of the scanner's 64 byte blocks
+  char buf[512];
+  for (int shift = 0; shift < 70; shift++) {
+    memset(buf, ' ', shift);
+    memcpy(buf + shift, "(ab -12.5 {c}) x-1", 18);
+    check(e, buf, shift + 18);
+  }
+
+  srand(1);
+  for (int i = 0; i < rounds && failures < 10; i++) {
+    size_t len = rand() % 200;
+    random_input(buf, len);
+    check(e, buf, len);
+
+    len = 1 + rand() % 500;
+    random_program(buf, len);
+    check(e, buf, len);
+  }
+
+  minilisp_delete(e);
+  if (failures)
+    fprintf(stderr, "read: %d failures\n", failures);
+  return failures != 0;
+}
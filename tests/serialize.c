@@ -0,0 +1,120 @@
+// Binary form of values: round trips, and malformed or too deeply nested
+// data being rejected.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// evaluate the program in text and check that its result survives a
+// round trip through the binary form
+void round_trip(lenv *e, const char *text) {
+  lval *v = minilisp_eval(e, text, strlen(text));
+  size_t size;
+  char *data = minilisp_serialize(v, &size);
+  CHECK(data, "%s: not serialized", text);
+  if (! data) {
+    minilisp_free(v);
+    return;
+  }
+
+  lval *w = minilisp_deserialize(data, size);
+  CHECK(w, "%s: not deserialized", text);
+  if (w) {
+    char *a = minilisp_format(v), *b = minilisp_format(w);
+    CHECK(! strcmp(a, b), "%s: %s came back as %s", text, a, b);
+    free(a);
+    free(b);
+    minilisp_free(w);
+  }
+
+  // any prefix is malformed
+  for (size_t n = 0; n < size; n++) {
+    lval *x = minilisp_deserialize(data, n);
+    CHECK(! x, "%s: a prefix of %zu bytes was accepted", text, n);
+    if (x)
+      minilisp_free(x);
+  }
+
+  free(data);
+  minilisp_free(v);
+}
+
+// lists nested depth deep around a symbol, as text
+char *nested(int depth) {
+  char *s = malloc(2 * depth + 2);
+  memset(s, '{', depth);
+  s[depth] = 'a';
+  memset(s + depth + 1, '}', depth);
+  s[2 * depth + 1] = '\0';
+  return s;
+}
+
+int main() {
+  lenv *e = minilisp_new();
+
+  round_trip(e, "1");
+  round_trip(e, "-0.1");
+  round_trip(e, "{}");
+  round_trip(e, "{1 2 3.5 -4e300}");
+  round_trip(e, "{a b {c {d 1 2} \"\"} + head}");
+  round_trip(e, "{(+ 1 2) {x y x y}}");
+  round_trip(e, "matrix {{1 2 3} {4 5 6}}");
+  round_trip(e, "{(matrix {{1}}) {1 {2 {3}}}}");
+  round_trip(e, "/ 1 0");
+
+  // the deepest value the format allows, and one list deeper
+  char *ok = nested(1024), *deep = nested(1025);
+  round_trip(e, ok);
+  lval *v = minilisp_eval(e, deep, strlen(deep));
+  size_t size;
+  char *data = minilisp_serialize(v, &size);
+  CHECK(! data, "a value nested 1025 deep was serialized");
+  free(data);
+  minilisp_free(v);
+  free(ok);
+  free(deep);
+
+  // crafted data: a million s-expressions of one element each, 2 bytes
+  // per level, has to be rejected without running out of stack
+  int levels = 1000000;
+  char *crafted = malloc(3 + 2 * levels + 9);
+  size = 0;
+  crafted[size++] = 'L';
+  crafted[size++] = 1;
+  crafted[size++] = 0;
+  for (int i = 0; i < levels; i++) {
+    crafted[size++] = 4;   // LBIN_SEXPR
+    crafted[size++] = 1;
+  }
+  crafted[size++] = 0;     // LBIN_NUM
+  memset(crafted + size, 0, 8);
+  size += 8;
+  v = minilisp_deserialize(crafted, size);
+  CHECK(! v, "data nested a million deep was accepted");
+  free(crafted);
+
+  // values nested that deep still free without recursion
+  deep = nested(levels);
+  v = minilisp_eval(e, deep, strlen(deep));
+  CHECK(minilisp_type(v) == LVAL_QEXPR, "a deeply nested list didn't evaluate to itself");
+  minilisp_free(v);
+  free(deep);
+
+  minilisp_delete(e);
+  if (failures)
+    fprintf(stderr, "serialize: %d failures\n", failures);
+  return failures != 0;
+}
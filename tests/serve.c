@@ -0,0 +1,119 @@
+// Server mode: requests are answered in order, and a request that grows past
+// the size limit without a newline is answered with an error and the
+// connection closed instead of being buffered without end.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "minilisp_internal.h"
+
+int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (! (cond)) { \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+// LSERVE_MAX_REQUEST in prompt.c
+#define MAX_REQUEST (1 << 20)
+
+char socket_path[64];
+
+int connect_server() {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  // the server may still be starting
+  for (int tries = 0; tries < 500; tries++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+      return fd;
+    close(fd);
+    struct timespec ts = { 0, 10000000 };
+    nanosleep(&ts, NULL);
+  }
+  return -1;
+}
+
+// sends the request bytes, then everything the server answers until it
+// closes the connection
+char *exchange(const char *data, size_t len) {
+  int fd = connect_server();
+  if (fd < 0)
+    return NULL;
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = write(fd, data + sent, len - sent);
+    if (n < 0)
+      break;
+    sent += n;
+  }
+  shutdown(fd, SHUT_WR);
+
+  lbuf b;
+  lbuf_init(&b, NULL);
+  char chunk[4096];
+  ssize_t n;
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+    lbuf_write(&b, chunk, n);
+  close(fd);
+  lbuf_putc(&b, '\0');
+  return b.data;
+}
+
+int main(void) {
+  signal(SIGPIPE, SIG_IGN);
+  snprintf(socket_path, sizeof(socket_path), "/tmp/minilisp-test-%d.sock", (int)getpid());
+  pid_t server = fork();
+  if (server == 0) {
+    execl("./prompt", "./prompt", "--serve", socket_path, (char*)NULL);
+    perror("./prompt");
+    _exit(1);
+  }
+
+  const char *pipelined = "+ 1 2\nhead {1 2}\n/ 1 0\n* 2 3";
+  char *got = exchange(pipelined, strlen(pipelined));
+  CHECK(got && ! strcmp(got, "3\n{1}\nError: Division by zero when trying to to divide.\n6\n"),
+    "pipelined requests answered with %s", got ? got : "nothing");
+  free(got);
+
+  // a request just over the limit, after one that is still answered
+  size_t len = strlen("+ 1 2\n") + MAX_REQUEST + 1;
+  char *big = malloc(len);
+  strcpy(big, "+ 1 2\n");
+  memset(big + strlen("+ 1 2\n"), 'x', MAX_REQUEST + 1);
+  got = exchange(big, len);
+  CHECK(got && ! strcmp(got, "3\nError: Request too long.\n"),
+    "an overlong request answered with %.200s", got ? got : "nothing");
+  free(got);
+  free(big);
+
+  // the server still takes requests
+  got = exchange("+ 4 5\n", 6);
+  CHECK(got && ! strcmp(got, "9\n"), "after an overlong request: %s", got ? got : "nothing");
+  free(got);
+
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  unlink(socket_path);
+
+  if (failures)
+    fprintf(stderr, "%d failures\n", failures);
+  return failures != 0;
+}